@@ -23,20 +23,37 @@
 #include <stddef.h>
 #include <signal.h>
 #include <libgen.h>
+#include <locale.h>
 #include <string.h>
 #include <limits.h>
 #include <dirent.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <poll.h>
 #include <pwd.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+# include <linux/sockios.h>
+/* SO_PEERCRED, only exposed by <sys/socket.h> with _GNU_SOURCE */
+# include <asm/socket.h>
+# include <sys/inotify.h>
+/* not declared in strict POSIX mode, but provided by all Linux C libraries */
+pid_t vfork(void);
+long syscall(long number, ...);
+#endif
+#if defined(__GLIBC__)
+# include <malloc.h>
+#endif
 #if defined(__linux__) || defined(__CYGWIN__)
 # include <pty.h>
 #elif defined(__FreeBSD__) || defined(__DragonFly__)
@@ -52,6 +69,12 @@
   #define CTRL(k)   ((k) & 0x1F)
 #endif
 
+enum Overflow {
+	OVERFLOW_BLOCK,      /* stop reading from the pty until the client caught up */
+	OVERFLOW_DROP,       /* discard output destined to the client */
+	OVERFLOW_DISCONNECT, /* drop the client */
+};
+
 #include "config.h"
 
 #if defined(_AIX)
@@ -61,6 +84,8 @@
 #endif
 
 #define countof(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 enum PacketType {
 	MSG_CONTENT = 0,
@@ -69,8 +94,73 @@ enum PacketType {
 	MSG_RESIZE  = 3,
 	MSG_EXIT    = 4,
 	MSG_PID     = 5,
+	MSG_HELLO   = 6,
+	MSG_STATS   = 7,
+	MSG_TIMING  = 8,
+	MSG_CREATE  = 9,
+	MSG_CLAIM   = 10,
+	MSG_TAIL    = 11, /* request for recent output, replied to with its length and the raw data */
 };
 
+/* capabilities requested in MSG_HELLO, the server replies with those it grants */
+enum {
+	CAP_TIMESTAMPS = 1 << 0, /* MSG_TIMING precedes output following our input */
+};
+
+/* Clients announce the protocol version and the largest packet payload they
+ * accept with MSG_HELLO, the server replies with the values both support.
+ * Peers which never sent a hello are limited to PACKET_LEGACY_MAX. */
+#define PROTOCOL_VERSION  1
+#define PACKET_MAX        (256 * 1024)
+#define PACKET_LEGACY_MAX (sizeof(((Packet*)0)->u.msg))
+
+/* Each server publishes a status page next to its socket and updates it in
+ * place. The server holds a write lock on the file, a page which is no longer
+ * locked belongs to a session whose server is gone. */
+#define STATUS_MAGIC 0x75646261 /* "abdu" */
+
+/* name of the control socket, next to those of the sessions, through which
+ * clients ask the daemon to host a session */
+#define DAEMON_SOCKET ".daemon"
+
+/* prefix of the names of warm sessions kept ready to be claimed, followed by
+ * a hash of their command, working directory and environment and the slot
+ * number */
+#define POOL_PREFIX ".pool-"
+
+/* maximal number of events the server handles per wakeup */
+#define SERVER_EVENTS 64
+
+typedef struct {
+	uint32_t magic;       /* STATUS_MAGIC once all fields are initialized */
+	uint32_t size;        /* of the structure, new fields are appended */
+	int64_t pid;          /* server process */
+	int64_t child;        /* supervised command */
+	int64_t started;      /* creation time in seconds since the epoch */
+	uint32_t clients;     /* number of connected clients */
+	int32_t exit_status;  /* of the command, -1 while it is running */
+	uint64_t pty_read;    /* bytes of output read from the pty */
+	uint64_t pty_written; /* bytes of input written to the pty */
+	uint64_t pty_reads;   /* read(2) calls on the pty */
+	uint64_t wakeups;     /* event loop iterations */
+	uint64_t busy;        /* microseconds spent handling events */
+	uint64_t startup;     /* microseconds from the creation request until serving */
+} Status;
+
+/* per client counters, reported in reply to MSG_STATS */
+typedef struct {
+	uint32_t id;          /* assigned in order of connection */
+	uint32_t flags;
+	uint32_t state;
+	uint32_t pad;
+	uint64_t sent;        /* bytes written to the socket */
+	uint64_t packets;     /* packets sent */
+	uint64_t dropped;     /* content bytes discarded due to the overflow policy */
+	uint64_t received;    /* bytes read from the socket */
+	uint64_t queued;      /* bytes pending, including the socket send buffer */
+	uint64_t queue_max;   /* largest output queue so far */
+} ClientStats;
+
 typedef struct {
 	uint32_t type;
 	uint32_t len;
@@ -82,12 +172,121 @@ typedef struct {
 		} ws;
 		uint32_t i;
 		uint64_t l;
+		struct {
+			uint32_t flags;
+			uint32_t refresh; /* conflated repaints per second, absent in old clients */
+		} attach;
+		struct {
+			uint32_t version;
+			uint32_t max;   /* largest payload accepted */
+			uint32_t caps;  /* capability flags */
+		} hello;
+		struct {
+			uint64_t received; /* input arrived at the server */
+			uint64_t written;  /* input was written to the pty */
+			uint64_t read;     /* the following output was read from the pty */
+			uint64_t sent;     /* and is now being sent */
+		} timing;            /* in microseconds of the monotonic clock */
+		Status status;       /* MSG_STATS reply, followed by one per client */
+		ClientStats client;
+		struct {
+			uint32_t argc;     /* followed by as many NUL terminated arguments */
+			uint32_t envc;     /* and environment variables */
+			uint32_t has_term;
+			struct winsize ws;
+			struct termios term;
+			uint64_t requested; /* clock_us() when the client started creating it */
+			uint32_t read_pty;  /* read output while no client is attached */
+			uint32_t record;    /* a recording is passed as the last descriptor */
+			uint32_t record_flags;
+		} create;            /* request to the daemon, replied to with an error message */
 	} u;
 } Packet;
 
+enum {
+	EVENT_READ  = 1 << 0,
+	EVENT_WRITE = 1 << 1,
+};
+
+typedef struct {
+	void *data;
+	int events;
+} Event;
+
+/* a write which is issued together with others, see event_writev() */
+typedef struct {
+	int fd;
+	struct iovec *iov;
+	int count;
+	ssize_t result;      /* as returned by writev(2) */
+	int error;           /* errno if the write failed */
+} EventWrite;
+
+typedef struct {
+	char *data;
+	size_t size;
+	size_t start, end;
+} Buffer;
+
+/* output stored once and referenced by the queues of all clients it is
+ * destined to, freed once the last of them wrote it out */
+typedef struct {
+	unsigned int refs;
+	size_t len, size;
+	char data[];
+} Chunk;
+
+/* part of a chunk which is still to be written */
+typedef struct {
+	Chunk *chunk;
+	size_t offset, len;
+} Segment;
+
+/* pending output of a client, a ring of segments */
+typedef struct {
+	Segment *segments;
+	size_t first, count, size;
+	size_t len;          /* bytes queued in all segments */
+} Queue;
+
+typedef struct Server Server;
+typedef struct PtyRing PtyRing;
+typedef struct Recorder Recorder;
+
+/* registered with the event loop, tells which kind of descriptor became ready */
+typedef struct {
+	enum {
+		SOURCE_SOCKET, /* listening socket of a session */
+		SOURCE_PTY,
+		SOURCE_CLIENT,
+		SOURCE_DAEMON, /* control socket of the daemon */
+		SOURCE_REQUEST, /* connection to the control socket */
+	} type;
+	Server *server;
+} Source;
+
+/* connection to the control socket of the daemon, over which a client asks
+ * to host a session, dropped unless the request arrived within PROBE_TIMEOUT */
+typedef struct Request Request;
+struct Request {
+	Source source;       /* registered with the event loop, has to come first */
+	int fd;              /* -1 once answered or failed */
+	Buffer input;
+	int fds[3];          /* descriptors passed along with the request */
+	long deadline;       /* server_clock_ms() until which the request has to arrive */
+	Request *next;
+};
+
 typedef struct Client Client;
 struct Client {
+	Source source;       /* registered with the event loop, has to come first */
 	int socket;
+	Buffer input;        /* received data not yet parsed into packets */
+	Queue output;        /* pending data not yet accepted by the socket */
+	size_t packet_max;   /* largest payload the peer accepts, negotiated by MSG_HELLO */
+	bool congested;      /* output queue exceeded QUEUE_HIGH, not yet below QUEUE_LOW */
+	bool stalled;        /* pty reads are paused on behalf of this client */
+	bool throttled;      /* input is not read while the pty input queue is full */
 	enum {
 		STATE_CONNECTED,
 		STATE_ATTACHED,
@@ -95,17 +294,28 @@ struct Client {
 		STATE_DISCONNECTED,
 	} state;
 	bool need_resize;
+	bool exit_sent;
 	enum {
 		CLIENT_READONLY = 1 << 0,
 		CLIENT_LOWPRIORITY = 1 << 1,
 	} flags;
+	unsigned int refresh; /* if non-zero, repaints per second instead of all output */
+	bool dirty;          /* screen changed since the last conflated repaint */
+	long repaint_at;     /* earliest time of the next conflated repaint */
+	bool monitor;        /* only queries statistics, is sent no output */
+	bool attached;       /* sent MSG_ATTACH, only then counted and sent output */
+	uint32_t caps;       /* granted by MSG_HELLO */
+	uint64_t input_at;   /* when the last input of the client arrived */
+	uint64_t written_at; /* and was written to the pty, zero once reported */
+	ClientStats stats;
 	Client *next;
 };
 
-typedef struct {
+/* A session, the server process hosts one of them unless it runs as a daemon.
+ * The global server instance additionally holds the process wide state. */
+struct Server {
 	Client *clients;
 	int socket;
-	Packet pty_output;
 	int pty;
 	int exit_status;
 	struct termios term;
@@ -115,10 +325,42 @@ typedef struct {
 	const char *name;
 	const char *session_name;
 	char host[255];
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)]; /* of the socket */
 	bool read_pty;
-} Server;
+	bool pty_watched;
+	bool pty_ready;      /* the pty became readable in the current iteration */
+	bool pty_writable;   /* the pty became writable in the current iteration */
+	int pty_events;      /* readiness the pty itself is watched for */
+	Buffer pty_input;    /* client input the pty did not accept yet */
+	bool exit_delivered; /* a client acknowledged the exit status */
+	uint64_t pty_read_at; /* when reading the batch started */
+	size_t pty_batch_limit; /* current batch size, adapts to the output rate */
+	struct Vt *vt;       /* screen state used to repaint attaching clients */
+	Buffer screen;       /* repaint of the current screen, shared by all clients */
+	Chunk *screen_chunk; /* copy of the repaint referenced by client queues */
+	bool screen_valid;   /* whether the repaint reflects the latest screen */
+	char *history;       /* ring of the most recent HISTORY_SIZE bytes of output */
+	uint64_t history_len; /* bytes appended to the ring so far */
+	int stalled;         /* number of clients pausing pty reads */
+	Status *status;      /* published status page, or the private copy */
+	Status status_private;
+	int status_fd;       /* holds the lock on the status page */
+	Source socket_source, pty_source;
+	PtyRing *ring;       /* filled by the reader thread, if any */
+	Recorder *recorder;  /* output is recorded to, if any */
+	int record_fd;       /* recording to start once the session is served */
+	uint32_t record_flags;
+	Server *prev, *next; /* all sessions hosted by this process */
+	Server *next_active; /* sessions to process in the current iteration */
+	bool active;
+	int daemon;          /* control socket accepting further sessions, if any */
+	uint64_t requested;  /* clock_us() when the client started creating the session */
+	bool released;       /* memory was freed since the process was last idle */
+	volatile sig_atomic_t socket_renew;
+	volatile sig_atomic_t child_died;
+};
 
-static Server server = { .running = true, .exit_status = -1, .host = "@localhost" };
+static Server server = { .running = true, .exit_status = -1, .host = "@localhost", .status = &server.status_private };
 static Client client;
 static struct termios orig_term, cur_term;
 static bool has_term, alternate_buffer, quiet, passthrough;
@@ -127,7 +369,16 @@ static struct sockaddr_un sockaddr = {
 	.sun_family = AF_UNIX,
 };
 
+extern char **environ;
+
 static bool set_socket_name(struct sockaddr_un *sockaddr, const char *name);
+static bool create_socket_dir(struct sockaddr_un *sockaddr);
+static socklen_t socket_address(struct sockaddr_un *addr, const char *path);
+static bool socket_path(char *buf, size_t size, struct sockaddr_un *addr, socklen_t len);
+static void socket_unlink(const char *path);
+static bool socket_peer_trusted(int fd);
+static bool status_path(char *buf, size_t size, const char *socket);
+static bool xsnprintf(char *buf, size_t size, const char *fmt, ...);
 static void die(const char *s);
 static void info(const char *str, ...);
 
@@ -141,6 +392,13 @@ static size_t packet_size(Packet *pkt) {
 	return packet_header_size() + pkt->len;
 }
 
+/* microseconds of the monotonic clock, which is shared by client and server */
+static uint64_t clock_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 static ssize_t write_all(int fd, const char *buf, size_t len) {
 	debug("write_all(%d)\n", len);
 	ssize_t ret = len;
@@ -179,30 +437,178 @@ static ssize_t read_all(int fd, char *buf, size_t len) {
 	return ret;
 }
 
-static bool send_packet(int socket, Packet *pkt) {
-	size_t size = packet_size(pkt);
-	if (size > sizeof(*pkt))
-		return false;
-	return write_all(socket, (char *)pkt, size) == size;
+static size_t buffer_len(Buffer *buf) {
+	return buf->end - buf->start;
 }
 
-static bool recv_packet(int socket, Packet *pkt) {
-	ssize_t len = read_all(socket, (char*)pkt, packet_header_size());
-	if (len <= 0 || len != packet_header_size())
-		return false;
-	if (pkt->len > sizeof(pkt->u.msg)) {
-		pkt->len = 0;
+/* make room for at least len more bytes at the end of the buffer */
+static bool buffer_reserve(Buffer *buf, size_t len) {
+	if (buf->end + len > buf->size && buf->start > 0) {
+		memmove(buf->data, buf->data + buf->start, buffer_len(buf));
+		buf->end -= buf->start;
+		buf->start = 0;
+	}
+	if (buf->end + len > buf->size) {
+		size_t size = buf->size ? buf->size : 4096;
+		while (size < buf->end + len)
+			size *= 2;
+		char *data = realloc(buf->data, size);
+		if (!data)
+			return false;
+		buf->data = data;
+		buf->size = size;
+	}
+	return true;
+}
+
+static bool buffer_append(Buffer *buf, const char *data, size_t len) {
+	if (!buffer_reserve(buf, len))
 		return false;
+	memcpy(buf->data + buf->end, data, len);
+	buf->end += len;
+	return true;
+}
+
+static void buffer_consume(Buffer *buf, size_t len) {
+	buf->start += len;
+	if (buf->start >= buf->end)
+		buf->start = buf->end = 0;
+}
+
+static void buffer_free(Buffer *buf) {
+	free(buf->data);
+	memset(buf, 0, sizeof *buf);
+}
+
+/* skip len bytes of the iovecs, returns the number of those remaining */
+static int iovec_advance(struct iovec **iov, int count, size_t len) {
+	for (; count > 0 && len >= (*iov)->iov_len; (*iov)++, count--)
+		len -= (*iov)->iov_len;
+	if (count > 0) {
+		(*iov)->iov_base = (char*)(*iov)->iov_base + len;
+		(*iov)->iov_len -= len;
 	}
-	if (pkt->len > 0) {
-		len = read_all(socket, pkt->u.msg, pkt->len);
-		if (len <= 0 || len != pkt->len)
+	return count;
+}
+
+static bool writev_all(int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		ssize_t len = writev(fd, iov, count);
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
 			return false;
+		}
+		count = iovec_advance(&iov, count, len);
 	}
 	return true;
 }
 
+/* Describe data as a sequence of packets of the given type with at most max
+ * payload bytes each, using up to n headers. The iovecs point to the headers
+ * and the payload, nothing is copied. Returns the number of iovecs filled in
+ * and advances data and len past the described part. */
+static int packet_iovec(uint32_t (*header)[2], int n, struct iovec *iov,
+                        uint32_t type, const char **data, size_t *len, size_t max) {
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		size_t size = MIN(*len, max);
+		header[i][0] = type; /* laid out as the Packet header */
+		header[i][1] = size;
+		iov[count++] = (struct iovec){ .iov_base = header[i], .iov_len = packet_header_size() };
+		iov[count++] = (struct iovec){ .iov_base = (char*)*data, .iov_len = size };
+		*data += size;
+		*len -= size;
+		if (*len == 0)
+			break;
+	}
+	return count;
+}
+
+static bool send_packets(int socket, uint32_t type, const char *data, size_t len, size_t max) {
+	uint32_t header[16][2];
+	struct iovec iov[2*countof(header)];
+	do {
+		int count = packet_iovec(header, countof(header), iov, type, &data, &len, max);
+		if (!writev_all(socket, iov, count))
+			return false;
+	} while (len > 0);
+	return true;
+}
+
+static bool send_packet(int socket, Packet *pkt) {
+	if (pkt->len > sizeof(pkt->u.msg))
+		return false;
+	return send_packets(socket, pkt->type, pkt->u.msg, pkt->len, PACKET_LEGACY_MAX);
+}
+
+/* read whatever is available, but at most size bytes, from fd into buf */
+static ssize_t buffer_read(Buffer *buf, int fd, size_t size) {
+	if (!buffer_reserve(buf, size))
+		return -1;
+	ssize_t len = read(fd, buf->data + buf->end, size);
+	if (len > 0)
+		buf->end += len;
+	return len;
+}
+
+/* Parse the next packet out of buf. Returns 1 if a complete packet was
+ * removed from the buffer, 0 if it did not fully arrive yet and -1 if the
+ * buffer does not contain a valid packet. Content packets and requests to
+ * the daemon may carry up to max bytes, their payload is then only available
+ * through *payload which remains valid until the buffer is read into again. */
+static int buffer_packet(Buffer *buf, Packet *pkt, size_t max, const char **payload) {
+	size_t header = packet_header_size();
+	if (buffer_len(buf) < header)
+		return 0;
+	memcpy(pkt, buf->data + buf->start, header);
+	if (pkt->len > sizeof(pkt->u.msg) &&
+	    ((pkt->type != MSG_CONTENT && pkt->type != MSG_CREATE) || pkt->len > max)) {
+		pkt->len = 0;
+		return -1;
+	}
+	if (buffer_len(buf) < header + pkt->len)
+		return 0;
+	const char *data = buf->data + buf->start + header;
+	if (pkt->len <= sizeof(pkt->u.msg))
+		memcpy(pkt->u.msg, data, pkt->len);
+	if (payload)
+		*payload = data;
+	buffer_consume(buf, header + pkt->len);
+	return 1;
+}
+
+/* perform the writes one after the other */
+static void event_writev_each(EventWrite *w, int count) {
+	for (int i = 0; i < count; i++) {
+		w[i].result = writev(w[i].fd, w[i].iov, w[i].count);
+		w[i].error = w[i].result == -1 ? errno : 0;
+	}
+}
+
+#if defined(__linux__)
+# include "event-epoll.c"
+#else
+# include "event-select.c"
+#endif
+
+#if defined(__linux__) && defined(HAVE_IO_URING)
+# include "event-io_uring.c"
+#else
+static void event_writev(EventWrite *w, int count) {
+	event_writev_each(w, count);
+}
+#endif
+
+#include "vt.c"
+#include "pty-thread.c"
 #include "client.c"
+#include "record.c"
 #include "server.c"
 
 static void info(const char *str, ...) {
@@ -223,7 +629,11 @@ static void die(const char *s) {
 }
 
 static void usage(void) {
-	fprintf(stderr, "usage: abduco [-a|-A|-c|-n] [-p] [-r] [-q] [-l] [-f] [-e detachkey] name command\n");
+	fprintf(stderr, "usage: abduco [-a|-A|-c|-n] [-p] [-W] [-r] [-q] [-l] [-f] [-D] [-o rate] [-L samples] [-R recording] [-e detachkey] name command\n"
+	                "       abduco -S [-o rate] [name]\n"
+	                "       abduco -t name [bytes]\n"
+	                "       abduco -w\n"
+	                "       abduco -P recording [speed [start]]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -243,48 +653,355 @@ static bool xsnprintf(char *buf, size_t size, const char *fmt, ...) {
 	return true;
 }
 
+/* Address of the socket at path, in the abstract namespace the path serves as
+ * its name. Paths relative to the socket directory are as found by
+ * session_scandir(). Returns the length of the address or 0. */
+static socklen_t socket_address(struct sockaddr_un *addr, const char *path) {
+	*addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+#if defined(__linux__)
+	if (SOCKET_ABSTRACT) {
+		struct sockaddr_un dir;
+		if (path[0] != '/' && !create_socket_dir(&dir))
+			return 0;
+		if (!xsnprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "%s%s",
+		               path[0] != '/' ? dir.sun_path : "", path))
+			return 0;
+		return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+	}
+#endif
+	if (!xsnprintf(addr->sun_path, sizeof addr->sun_path, "%s", path))
+		return 0;
+	return offsetof(struct sockaddr_un, sun_path) + strlen(addr->sun_path) + 1;
+}
+
+/* path of a socket as returned by getsockname(2) */
+static bool socket_path(char *buf, size_t size, struct sockaddr_un *addr, socklen_t len) {
+	const char *name = addr->sun_path;
+	int namelen = len - offsetof(struct sockaddr_un, sun_path);
+	if (namelen > 0 && !name[0]) {
+		name++;
+		namelen--;
+	}
+	return namelen > 0 && xsnprintf(buf, size, "%.*s", namelen, name);
+}
+
+/* sockets in the abstract namespace are removed along with their last descriptor */
+static void socket_unlink(const char *path) {
+	if (!SOCKET_ABSTRACT)
+		unlink(path);
+}
+
+/* Sockets in the abstract namespace lack the permissions of the directory,
+ * there only peers of the same user are trusted. */
+static bool socket_peer_trusted(int fd) {
+#if defined(__linux__) && defined(SO_PEERCRED)
+	struct { pid_t pid; uid_t uid; gid_t gid; } cred; /* struct ucred */
+	socklen_t len = sizeof cred;
+	if (SOCKET_ABSTRACT && (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+	                        cred.uid != getuid())) {
+		errno = EACCES;
+		return false;
+	}
+#endif
+	return true;
+}
+
 static int session_connect(const char *name) {
 	int fd;
 	struct stat sb;
-	if (!set_socket_name(&sockaddr, name) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	struct sockaddr_un addr;
+	socklen_t socklen;
+	if (!set_socket_name(&sockaddr, name) || !(socklen = socket_address(&addr, sockaddr.sun_path)) ||
+	    (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
 		return -1;
-	socklen_t socklen = offsetof(struct sockaddr_un, sun_path) + strlen(sockaddr.sun_path) + 1;
-	if (connect(fd, (struct sockaddr*)&sockaddr, socklen) == -1) {
-		if (errno == ECONNREFUSED && stat(sockaddr.sun_path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+	if (connect(fd, (struct sockaddr*)&addr, socklen) == -1) {
+		if (errno == ECONNREFUSED && !SOCKET_ABSTRACT && stat(sockaddr.sun_path, &sb) == 0 && S_ISSOCK(sb.st_mode))
 			unlink(sockaddr.sun_path);
 		close(fd);
 		return -1;
 	}
+	if (!socket_peer_trusted(fd)) {
+		close(fd);
+		return -1;
+	}
 	return fd;
 }
 
+static bool status_path(char *buf, size_t size, const char *socket) {
+	return xsnprintf(buf, size, "%s.status", socket);
+}
+
+/* Read the status page of the session listening on the given socket path.
+ * Returns 1 if the server is alive, -1 if it is gone and 0 if there is
+ * no (complete) page, e.g. because the server predates them. */
+static int session_status(const char *socket, Status *status) {
+	char path[PATH_MAX];
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	int fd, alive = 0;
+	if (!status_path(path, sizeof path, socket) || (fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return 0;
+	memset(status, 0, sizeof *status);
+	if (pread(fd, status, sizeof *status, 0) >= (ssize_t)offsetof(Status, startup) &&
+	    status->magic == STATUS_MAGIC && fcntl(fd, F_GETLK, &lock) == 0)
+		alive = lock.l_type == F_UNLCK ? -1 : 1;
+	close(fd);
+	return alive;
+}
+
+static void session_remove(const char *socket) {
+	char path[PATH_MAX];
+	if (status_path(path, sizeof path, socket))
+		unlink(path);
+	socket_unlink(socket);
+}
+
+typedef struct {
+	char *path;        /* of the session socket */
+	char *local;       /* start of the host name suffix, if any */
+	time_t started;
+	char status;       /* as displayed in the session list */
+	bool probe;        /* whether the pid has to be requested from the server */
+	bool unresponsive; /* server did not reply within PROBE_TIMEOUT */
+	pid_t pid;
+	long deadline;
+	Buffer input;
+} Session;
+
+/* start a non-blocking connection attempt, stale sockets are removed */
+static int session_probe_connect(Session *s) {
+	struct sockaddr_un addr;
+	struct stat sb;
+	socklen_t socklen = socket_address(&addr, s->path);
+	if (!socklen)
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	if (server_set_socket_non_blocking(fd) == 0 &&
+	    ((connect(fd, (struct sockaddr*)&addr, socklen) == 0 && socket_peer_trusted(fd)) ||
+	     errno == EINPROGRESS))
+		return fd;
+	if (errno == ECONNREFUSED && !SOCKET_ABSTRACT && stat(s->path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		unlink(s->path);
+	else if (errno == EAGAIN) /* backlog is full, the server does not accept */
+		s->unresponsive = true;
+	close(fd);
+	return -1;
+}
+
+/* Request the pid from all sessions marked for probing, with a bounded number
+ * of connections in flight. Servers which do not reply before their deadline
+ * are marked unresponsive, those which are gone keep a zero pid. */
+static void session_probe(Session *sessions, size_t count) {
+	struct pollfd pfd[64];
+	Session *probe[countof(pfd)];
+	nfds_t active = 0;
+	size_t next = 0;
+
+	for (;;) {
+		long now = server_clock_ms();
+		while (active < countof(pfd) && next < count) {
+			Session *s = &sessions[next++];
+			int fd;
+			if (!s->probe || (fd = session_probe_connect(s)) == -1)
+				continue;
+			s->deadline = now + PROBE_TIMEOUT;
+			pfd[active] = (struct pollfd){ .fd = fd, .events = POLLIN };
+			probe[active++] = s;
+		}
+		if (active == 0)
+			break;
+
+		long timeout = probe[0]->deadline - now;
+		for (nfds_t i = 1; i < active; i++)
+			timeout = MIN(timeout, probe[i]->deadline - now);
+		if (poll(pfd, active, MAX(timeout, 0)) == -1 && errno != EINTR)
+			die("session-probe");
+
+		now = server_clock_ms();
+		for (nfds_t i = active; i-- > 0;) {
+			Session *s = probe[i];
+			bool done = false;
+			if (pfd[i].revents) {
+				Packet pkt;
+				ssize_t len = buffer_read(&s->input, pfd[i].fd, sizeof pkt);
+				int r = buffer_packet(&s->input, &pkt, PACKET_LEGACY_MAX, NULL);
+				if (r == 1 && pkt.type == MSG_PID)
+					s->pid = pkt.u.l;
+				done = r != 0 || len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR);
+			}
+			if (!done && now < s->deadline)
+				continue;
+			s->unresponsive = !done;
+			buffer_free(&s->input);
+			close(pfd[i].fd);
+			pfd[i] = pfd[--active];
+			probe[i] = probe[active];
+		}
+	}
+}
+
 static pid_t session_exists(const char *name) {
-	Packet pkt;
-	pid_t pid = 0;
-	if ((server.socket = session_connect(name)) == -1)
-		return pid;
-	if (client_recv_packet(&pkt) && pkt.type == MSG_PID)
-		pid = pkt.u.l;
-	close(server.socket);
-	return pid;
+	Status page;
+	if (!set_socket_name(&sockaddr, name))
+		return 0;
+	Session s = { .path = sockaddr.sun_path, .probe = true };
+	switch (session_status(s.path, &page)) {
+	case 1:
+		return page.pid;
+	case -1:
+		session_remove(s.path);
+		return 0;
+	}
+	session_probe(&s, 1);
+	return s.pid;
 }
 
 static bool session_alive(const char *name) {
 	struct stat sb;
-	return session_exists(name) &&
-	       stat(sockaddr.sun_path, &sb) == 0 &&
+	Status page;
+	if (!session_exists(name))
+		return false;
+	/* whether the command terminated is otherwise kept in the mode of the socket */
+	if (SOCKET_ABSTRACT)
+		return session_status(sockaddr.sun_path, &page) != 1 || page.exit_status == -1;
+	return stat(sockaddr.sun_path, &sb) == 0 &&
 	       S_ISSOCK(sb.st_mode) && (sb.st_mode & S_IXGRP) == 0;
 }
 
+/* looked up only if the environment does not tell, it might involve NSS */
+static struct passwd *socket_dir_passwd(void) {
+	static bool done;
+	static struct passwd *pw;
+	if (!done) {
+		pw = getpwuid(getuid());
+		done = true;
+	}
+	return pw;
+}
+
+/* create the directory unless it exists, then make sure it is one */
+static bool socket_dir_create(const char *path, mode_t mode, struct stat *sb) {
+	mode_t mask = umask(0);
+	int r = mkdir(path, mode);
+	umask(mask);
+	if (r != 0 && errno != EEXIST)
+		return false;
+	if (lstat(path, sb) != 0)
+		return false;
+	if (!S_ISDIR(sb->st_mode)) {
+		errno = ENOTDIR;
+		return false;
+	}
+	return true;
+}
+
+static bool socket_dir_private(struct stat *sb) {
+	if (sb->st_uid == getuid() && !(sb->st_mode & (S_IRWXG|S_IRWXO)))
+		return true;
+	errno = EACCES;
+	return false;
+}
+
+/* append and create a sub directory only accessible to the user, it is
+ * named after $USER unless a directory of that name belongs to someone else */
+static bool socket_dir_create_personal(char *path, size_t size, struct stat *sb) {
+	size_t len = strlen(path);
+	const char *user = getenv("USER");
+	if (user && user[0] && !strchr(user, '/') && xsnprintf(path+len, size-len, "%s/", user) &&
+	    socket_dir_create(path, S_IRWXU, sb) && socket_dir_private(sb))
+		return true;
+	struct passwd *pw = socket_dir_passwd();
+	if (pw && user && !strcmp(pw->pw_name, user))
+		return false;
+	if (pw && !xsnprintf(path+len, size-len, "%s/", pw->pw_name))
+		return false;
+	if (!pw && !xsnprintf(path+len, size-len, "%d/", getuid()))
+		return false;
+	return socket_dir_create(path, S_IRWXU, sb) && socket_dir_private(sb);
+}
+
+/* The directory resolved by an earlier invocation is remembered in
+ * $XDG_RUNTIME_DIR, which is private to the user and emptied upon reboot.
+ * It is used as long as the environment it was resolved from is unchanged
+ * and it is still the same directory, only accessible to the user. */
+static bool socket_dir_cache_path(char *buf, size_t size) {
+	const char *runtime = getenv("XDG_RUNTIME_DIR");
+	return runtime && runtime[0] == '/' && xsnprintf(buf, size, "%s/%s.dir", runtime, server.name);
+}
+
+/* of the environment the socket directory is resolved from */
+static uint32_t socket_dir_hash(void) {
+	uint32_t hash = 2166136261u; /* FNV-1a */
+	for (unsigned int i = 0; i <= countof(socket_dirs); i++) {
+		const char *c = i == countof(socket_dirs) ? server.name :
+		                socket_dirs[i].env ? getenv(socket_dirs[i].env) : socket_dirs[i].path;
+		for (c = c ? c : ""; ; c++) {
+			hash = (hash ^ (unsigned char)*c) * 16777619u;
+			if (!*c)
+				break;
+		}
+	}
+	return hash;
+}
+
+static bool socket_dir_cache_load(char *dir, size_t size) {
+	char path[PATH_MAX], buf[64 + PATH_MAX];
+	struct stat sb;
+	if (!socket_dir_cache_path(path, sizeof path))
+		return false;
+	int fd = open(path, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+	if (fd == -1)
+		return false;
+	ssize_t len = -1;
+	if (fstat(fd, &sb) == 0 && sb.st_uid == getuid())
+		len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0 || buf[len-1] != '\n')
+		return false;
+	buf[len-1] = '\0';
+	uint32_t hash;
+	uintmax_t dev, ino;
+	int offset = 0;
+	if (sscanf(buf, "%"SCNx32" %ju %ju %n", &hash, &dev, &ino, &offset) != 3 || !offset ||
+	    hash != socket_dir_hash() || strlen(buf + offset) >= size)
+		return false;
+	if (lstat(buf + offset, &sb) != 0 || !S_ISDIR(sb.st_mode) || !socket_dir_private(&sb) ||
+	    sb.st_dev != dev || sb.st_ino != ino)
+		return false;
+	strcpy(dir, buf + offset);
+	return true;
+}
+
+static void socket_dir_cache_store(const char *dir, struct stat *sb) {
+	char path[PATH_MAX], tmp[PATH_MAX], buf[64 + PATH_MAX];
+	if (strchr(dir, '\n') || !socket_dir_cache_path(path, sizeof path) ||
+	    !xsnprintf(tmp, sizeof tmp, "%s.%d", path, getpid()) ||
+	    !xsnprintf(buf, sizeof buf, "%08"PRIx32" %ju %ju %s\n", socket_dir_hash(),
+	               (uintmax_t)sb->st_dev, (uintmax_t)sb->st_ino, dir))
+		return;
+	int fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if (fd == -1)
+		return;
+	bool written = write_all(fd, buf, strlen(buf)) == strlen(buf);
+	close(fd);
+	if (!written || rename(tmp, path) == -1)
+		unlink(tmp);
+}
+
 static bool create_socket_dir(struct sockaddr_un *sockaddr) {
+	/* resolved once, creating a session would otherwise do so repeatedly */
+	static char socket_dir[sizeof(sockaddr->sun_path)];
+	if (socket_dir[0] || socket_dir_cache_load(socket_dir, sizeof socket_dir)) {
+		memcpy(sockaddr->sun_path, socket_dir, sizeof(socket_dir));
+		return true;
+	}
 	sockaddr->sun_path[0] = '\0';
 	int socketfd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (socketfd == -1)
 		return false;
 
 	const size_t maxlen = sizeof(sockaddr->sun_path);
-	uid_t uid = getuid();
-	struct passwd *pw = getpwuid(uid);
 
 	for (unsigned int i = 0; i < countof(socket_dirs); i++) {
 		struct stat sb;
@@ -293,48 +1010,19 @@ static bool create_socket_dir(struct sockaddr_un *sockaddr) {
 		if (dir->env) {
 			dir->path = getenv(dir->env);
 			ishome = !strcmp(dir->env, "HOME");
-			if (ishome && (!dir->path || !dir->path[0]) && pw)
-				dir->path = pw->pw_dir;
+			if (ishome && (!dir->path || !dir->path[0]) && socket_dir_passwd())
+				dir->path = socket_dir_passwd()->pw_dir;
 		}
 		if (!dir->path || !dir->path[0])
 			continue;
 		if (!xsnprintf(sockaddr->sun_path, maxlen, "%s/%s%s/", dir->path, ishome ? "." : "", server.name))
 			continue;
-		mode_t mask = umask(0);
-		int r = mkdir(sockaddr->sun_path, dir->personal ? S_IRWXU : S_IRWXU|S_IRWXG|S_IRWXO|S_ISVTX);
-		umask(mask);
-		if (r != 0 && errno != EEXIST)
+		if (!socket_dir_create(sockaddr->sun_path, dir->personal ? S_IRWXU : S_IRWXU|S_IRWXG|S_IRWXO|S_ISVTX, &sb))
 			continue;
-		if (lstat(sockaddr->sun_path, &sb) != 0)
+		if (dir->personal ? !socket_dir_private(&sb) : !socket_dir_create_personal(sockaddr->sun_path, maxlen, &sb))
 			continue;
-		if (!S_ISDIR(sb.st_mode)) {
-			errno = ENOTDIR;
-			continue;
-		}
 
 		size_t dirlen = strlen(sockaddr->sun_path);
-		if (!dir->personal) {
-			/* create subdirectory only accessible to user */
-			if (pw && !xsnprintf(sockaddr->sun_path+dirlen, maxlen-dirlen, "%s/", pw->pw_name))
-				continue;
-			if (!pw && !xsnprintf(sockaddr->sun_path+dirlen, maxlen-dirlen, "%d/", uid))
-				continue;
-			if (mkdir(sockaddr->sun_path, S_IRWXU) != 0 && errno != EEXIST)
-				continue;
-			if (lstat(sockaddr->sun_path, &sb) != 0)
-				continue;
-			if (!S_ISDIR(sb.st_mode)) {
-				errno = ENOTDIR;
-				continue;
-			}
-			dirlen = strlen(sockaddr->sun_path);
-		}
-
-		if (sb.st_uid != uid || sb.st_mode & (S_IRWXG|S_IRWXO)) {
-			errno = EACCES;
-			continue;
-		}
-
 		if (!xsnprintf(sockaddr->sun_path+dirlen, maxlen-dirlen, ".abduco-%d", getpid()))
 			continue;
 
@@ -344,6 +1032,8 @@ static bool create_socket_dir(struct sockaddr_un *sockaddr) {
 		unlink(sockaddr->sun_path);
 		close(socketfd);
 		sockaddr->sun_path[dirlen] = '\0';
+		memcpy(socket_dir, sockaddr->sun_path, sizeof(socket_dir));
+		socket_dir_cache_store(socket_dir, &sb);
 		return true;
 	}
 
@@ -390,98 +1080,243 @@ static bool set_socket_name(struct sockaddr_un *sockaddr, const char *name) {
 	return true;
 }
 
+/* socket through which the daemon of the socket directory is reached */
+static bool daemon_socket_name(struct sockaddr_un *addr) {
+	if (!create_socket_dir(addr))
+		return false;
+	size_t len = strlen(addr->sun_path);
+	return xsnprintf(addr->sun_path + len, sizeof(addr->sun_path) - len, "%s%s", DAEMON_SOCKET, server.host);
+}
+
+/* Connect to the daemon. If there is none, bind its socket to server.daemon
+ * such that the server about to be started becomes the daemon. */
+static int daemon_connect(void) {
+	struct sockaddr_un path = { .sun_family = AF_UNIX }, addr;
+	socklen_t socklen;
+	if (!daemon_socket_name(&path) || !(socklen = socket_address(&addr, path.sun_path)))
+		return -1;
+	for (int i = 0; i < 3; i++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1)
+			return -1;
+		if (connect(fd, (struct sockaddr*)&addr, socklen) == 0) {
+			if (socket_peer_trusted(fd))
+				return fd;
+			break;
+		}
+		if (errno == ECONNREFUSED)
+			socket_unlink(path.sun_path);
+		else if (errno != ENOENT)
+			break;
+		close(fd);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			return -1;
+		mode_t mask = umask(S_IXUSR|S_IRWXG|S_IRWXO);
+		int r = bind(fd, (struct sockaddr*)&addr, socklen);
+		umask(mask);
+		if (r == 0 && listen(fd, 64) == 0 && server_set_cloexec(fd) == 0) {
+			server.daemon = fd;
+			return -1;
+		}
+		if (r == 0)
+			socket_unlink(path.sun_path);
+		if (r == 0 || errno != EADDRINUSE)
+			break;
+		/* another client just started the daemon, connect to it */
+		close(fd);
+	}
+	return -1;
+}
+
+/* Pass the socket of the session, our working directory, the recording, if
+ * any, command line and environment to the daemon. Returns false if the daemon went away before
+ * replying, the reply is otherwise stored in msg and empty on success. */
+static bool daemon_request(int fd, char * const argv[], char *msg, size_t size) {
+	Packet pkt = {
+		.type = MSG_CREATE,
+		.u.create = {
+			.has_term = has_term,
+			.ws = server.winsize,
+			.term = server.term,
+			.requested = server.requested,
+			.read_pty = server.read_pty,
+			.record = server.record_fd > 0,
+			.record_flags = server.record_flags,
+		},
+	};
+	Buffer args = { 0 };
+	bool sent = false;
+	msg[0] = '\0';
+
+	for (; argv[pkt.u.create.argc]; pkt.u.create.argc++) {
+		const char *arg = argv[pkt.u.create.argc];
+		if (!buffer_append(&args, arg, strlen(arg) + 1))
+			goto error;
+	}
+	for (; environ[pkt.u.create.envc]; pkt.u.create.envc++) {
+		const char *var = environ[pkt.u.create.envc];
+		if (!buffer_append(&args, var, strlen(var) + 1))
+			goto error;
+	}
+	if (sizeof pkt.u.create + buffer_len(&args) > PACKET_MAX) {
+		errno = E2BIG;
+		goto error;
+	}
+	pkt.len = sizeof pkt.u.create + buffer_len(&args);
+
+	int cwd = open(".", O_RDONLY|O_CLOEXEC);
+	int fds[3] = { server.socket, cwd }, nfds = cwd == -1 ? 1 : 2;
+	if (server.record_fd > 0)
+		fds[nfds++] = server.record_fd;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof fds)];
+	} cmsg;
+	memset(&cmsg, 0, sizeof cmsg);
+	struct iovec iovecs[] = {
+		{ .iov_base = &pkt, .iov_len = packet_header_size() + sizeof pkt.u.create },
+		{ .iov_base = args.data, .iov_len = buffer_len(&args) },
+	}, *iov = iovecs;
+	struct msghdr msghdr = {
+		.msg_iov = iov,
+		.msg_iovlen = countof(iovecs),
+		.msg_control = &cmsg,
+		.msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+	};
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msghdr);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+	ssize_t len = sendmsg(fd, &msghdr, 0);
+	if (len != -1)
+		sent = writev_all(fd, iov, iovec_advance(&iov, countof(iovecs), len));
+	if (cwd != -1)
+		close(cwd);
+	buffer_free(&args);
+	if (!sent)
+		return false;
+
+	if (read_all(fd, (char*)&pkt, packet_header_size()) != (ssize_t)packet_header_size() ||
+	    pkt.type != MSG_CREATE || pkt.len >= size || read_all(fd, msg, pkt.len) != pkt.len)
+		return false;
+	msg[pkt.len] = '\0';
+	return true;
+error:
+	snprintf(msg, size, "daemon-request: %s\n", strerror(errno));
+	buffer_free(&args);
+	return true;
+}
+
+/* Have the daemon host the session whose socket was just created. Returns 1
+ * on success, 0 if there is no daemon yet and -1 on error. */
+static int daemon_create_session(char * const argv[]) {
+	char errormsg[255];
+	for (int i = 0; i < 3; i++) {
+		int fd = daemon_connect();
+		if (fd == -1)
+			return server.daemon > 0 ? 0 : -1;
+		bool replied = daemon_request(fd, argv, errormsg, sizeof(errormsg));
+		close(fd);
+		/* the daemon exited after its last session terminated, start anew */
+		if (!replied)
+			continue;
+		if (errormsg[0]) {
+			write_all(STDERR_FILENO, errormsg, strlen(errormsg));
+			unlink(server.path);
+			exit(EXIT_FAILURE);
+		}
+		close(server.socket);
+		server.socket = 0;
+		return 1;
+	}
+	errno = ECONNRESET;
+	return -1;
+}
+
 static bool create_session(const char *name, char * const argv[]) {
 	/* this uses the well known double fork strategy as described in section 1.7 of
 	 *
 	 *  http://www.faqs.org/faqs/unix-faq/programmer/faq/
 	 *
-	 * pipes are used for synchronization and error reporting i.e. the child sets
-	 * the close on exec flag before calling execvp(3) the parent blocks on a read(2)
-	 * in case of failure the error message is written to the pipe, success is
-	 * indicated by EOF on the pipe.
+	 * a pipe is used for synchronization and error reporting i.e. it is marked
+	 * close on exec and the parent blocks on a read(2), in case of failure the
+	 * error message is written to the pipe, success is indicated by EOF.
 	 */
-	int client_pipe[2], server_pipe[2];
+	int client_pipe[2];
 	pid_t pid;
 	char errormsg[255];
 	struct sigaction sa;
 
+	server.requested = clock_us();
 	if (session_exists(name)) {
 		errno = EADDRINUSE;
 		return false;
 	}
 
-	if (pipe(client_pipe) == -1)
-		return false;
 	if ((server.socket = server_create_socket(name)) == -1)
 		return false;
+	memcpy(server.path, sockaddr.sun_path, sizeof(server.path));
+
+	if (SESSION_DAEMON) {
+		switch (daemon_create_session(argv)) {
+		case 1:
+			return true;
+		case -1:
+			unlink(server.path);
+			return false;
+		}
+		/* no daemon is running yet, the server about to be started becomes it */
+	}
+
+	if (pipe(client_pipe) == -1 || server_set_cloexec(client_pipe[1]) == -1) {
+		unlink(server.path);
+		return false;
+	}
 
 	switch ((pid = fork())) {
 	case 0: /* child process */
 		setsid();
 		close(client_pipe[0]);
 		switch ((pid = fork())) {
-		case 0: /* child process */
-			if (pipe(server_pipe) == -1) {
-				snprintf(errormsg, sizeof(errormsg), "server-pipe: %s\n", strerror(errno));
-				write_all(client_pipe[1], errormsg, strlen(errormsg));
-				close(client_pipe[1]);
-				_exit(EXIT_FAILURE);
-			}
+		case 0: /* child = server process */
 			sa.sa_flags = 0;
 			sigemptyset(&sa.sa_mask);
 			sa.sa_handler = server_pty_died_handler;
 			sigaction(SIGCHLD, &sa, NULL);
-			switch (server.pid = forkpty(&server.pty, NULL, has_term ? &server.term : NULL, &server.winsize)) {
-			case 0: /* child = user application process */
-				close(server.socket);
-				close(server_pipe[0]);
-				if (fcntl(client_pipe[1], F_SETFD, FD_CLOEXEC) == 0 &&
-				    fcntl(server_pipe[1], F_SETFD, FD_CLOEXEC) == 0)
-					execvp(argv[0], argv);
-				snprintf(errormsg, sizeof(errormsg), "server-execvp: %s: %s\n",
-						 argv[0], strerror(errno));
+			sa.sa_handler = server_sigterm_handler;
+			sigaction(SIGTERM, &sa, NULL);
+			sigaction(SIGINT, &sa, NULL);
+			sa.sa_handler = server_sigusr1_handler;
+			sigaction(SIGUSR1, &sa, NULL);
+			sa.sa_handler = SIG_IGN;
+			sigaction(SIGPIPE, &sa, NULL);
+			sigaction(SIGHUP, &sa, NULL);
+			if (!server_spawn(&server, argv, NULL, -1, has_term ? &server.term : NULL,
+			                  errormsg, sizeof(errormsg))) {
 				write_all(client_pipe[1], errormsg, strlen(errormsg));
-				write_all(server_pipe[1], errormsg, strlen(errormsg));
 				close(client_pipe[1]);
-				close(server_pipe[1]);
 				_exit(EXIT_FAILURE);
-				break;
-			case -1: /* forkpty failed */
-				snprintf(errormsg, sizeof(errormsg), "server-forkpty: %s\n", strerror(errno));
-				write_all(client_pipe[1], errormsg, strlen(errormsg));
-				close(client_pipe[1]);
-				close(server_pipe[0]);
-				close(server_pipe[1]);
+			}
+			if (chdir("/") == -1)
 				_exit(EXIT_FAILURE);
-				break;
-			default: /* parent = server process */
-				sa.sa_handler = server_sigterm_handler;
-				sigaction(SIGTERM, &sa, NULL);
-				sigaction(SIGINT, &sa, NULL);
-				sa.sa_handler = server_sigusr1_handler;
-				sigaction(SIGUSR1, &sa, NULL);
-				sa.sa_handler = SIG_IGN;
-				sigaction(SIGPIPE, &sa, NULL);
-				sigaction(SIGHUP, &sa, NULL);
-				if (chdir("/") == -1)
-					_exit(EXIT_FAILURE);
-			#ifdef NDEBUG
-				int fd = open("/dev/null", O_RDWR);
-				if (fd != -1) {
-					dup2(fd, STDIN_FILENO);
-					dup2(fd, STDOUT_FILENO);
-					dup2(fd, STDERR_FILENO);
-					close(fd);
-				}
-			#endif /* NDEBUG */
-				close(client_pipe[1]);
-				close(server_pipe[1]);
-				if (read_all(server_pipe[0], errormsg, sizeof(errormsg)) > 0)
-					_exit(EXIT_FAILURE);
-				close(server_pipe[0]);
-				server_mainloop();
-				break;
+		#ifdef NDEBUG
+			int fd = open("/dev/null", O_RDWR);
+			if (fd != -1) {
+				dup2(fd, STDIN_FILENO);
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+				close(fd);
 			}
+		#endif /* NDEBUG */
+			close(client_pipe[1]);
+			/* a daemon needs a few descriptors for each session it hosts */
+			struct rlimit rl;
+			if (server.daemon > 0 && getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+				rl.rlim_cur = rl.rlim_max;
+				setrlimit(RLIMIT_NOFILE, &rl);
+			}
+			server_mainloop(&server);
 			break;
 		case -1: /* fork failed */
 			snprintf(errormsg, sizeof(errormsg), "server-fork: %s\n", strerror(errno));
@@ -501,11 +1336,15 @@ static bool create_session(const char *name, char * const argv[]) {
 		return false;
 	default: /* parent = client process */
 		close(client_pipe[1]);
+		if (server.daemon > 0) {
+			close(server.daemon);
+			server.daemon = 0;
+		}
 		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
 		ssize_t len = read_all(client_pipe[0], errormsg, sizeof(errormsg));
 		if (len > 0) {
 			write_all(STDERR_FILENO, errormsg, len);
-			unlink(sockaddr.sun_path);
+			unlink(server.path);
 			exit(EXIT_FAILURE);
 		}
 		close(client_pipe[0]);
@@ -546,16 +1385,100 @@ static bool attach_session(const char *name, const bool terminate) {
 }
 
 static int session_filter(const struct dirent *d) {
+	const char *suffix = ".status";
+	size_t len = strlen(d->d_name), suffix_len = strlen(suffix), daemon_len = strlen(DAEMON_SOCKET);
+	if (len > suffix_len && !strcmp(d->d_name + len - suffix_len, suffix))
+		return 0;
+	if (!strncmp(d->d_name, DAEMON_SOCKET, daemon_len) && !strcmp(d->d_name + daemon_len, server.host))
+		return 0;
+	if (!strncmp(d->d_name, POOL_PREFIX, strlen(POOL_PREFIX)))
+		return 0;
 	return strstr(d->d_name, server.host) != NULL;
 }
 
-static int session_comparator(const struct dirent **a, const struct dirent **b) {
-	struct stat sa, sb;
-	if (stat((*a)->d_name, &sa) != 0)
+/* warm sessions of the pools, see pool_fill() */
+static int pool_filter(const struct dirent *d) {
+	const char *suffix = ".status";
+	size_t len = strlen(d->d_name), suffix_len = strlen(suffix);
+	if (len > suffix_len && !strcmp(d->d_name + len - suffix_len, suffix))
+		return 0;
+	return !strncmp(d->d_name, POOL_PREFIX, strlen(POOL_PREFIX)) && strstr(d->d_name, server.host);
+}
+
+static int (*session_scandir_compar)(const struct dirent**, const struct dirent**);
+
+static int session_scandir_compare(const void *a, const void *b) {
+	return session_scandir_compar((const struct dirent**)a, (const struct dirent**)b);
+}
+
+/* Like scandir(3) on the socket directory, which the caller changed into.
+ * Sessions bound in the abstract namespace are found in /proc/net/unix, their
+ * names are those their sockets would have in the directory. */
+static int session_scandir(struct dirent ***namelist, int (*filter)(const struct dirent*),
+                           int (*compar)(const struct dirent**, const struct dirent**)) {
+	if (!SOCKET_ABSTRACT)
+		return scandir(".", namelist, filter, compar);
+	struct sockaddr_un dir;
+	struct dirent **list = NULL;
+	size_t count = 0, size = 0, linesize = 0;
+	char *line = NULL;
+	FILE *file;
+	if (!create_socket_dir(&dir) || !(file = fopen("/proc/net/unix", "r")))
 		return -1;
-	if (stat((*b)->d_name, &sb) != 0)
-		return 1;
-	return sa.st_atime < sb.st_atime ? -1 : 1;
+	size_t dirlen = strlen(dir.sun_path);
+	while (getline(&line, &linesize, file) > 0) {
+		unsigned long flags;
+		int offset = 0;
+		/* Num RefCount Protocol Flags Type St Inode Path, listening sockets
+		 * are flagged with __SO_ACCEPTCON and the leading NUL shown as @ */
+		if (sscanf(line, "%*s %*s %*s %lx %*s %*s %*s %n", &flags, &offset) != 1 || !offset)
+			continue;
+		char *name = line + offset;
+		name[strcspn(name, "\n")] = '\0';
+		if (!(flags & 0x10000) || name[0] != '@' || strncmp(name + 1, dir.sun_path, dirlen))
+			continue;
+		name += 1 + dirlen;
+		struct dirent *d;
+		if (strchr(name, '/') || strlen(name) >= sizeof d->d_name)
+			continue;
+		if (count == size) {
+			size = MAX(size * 2, 16);
+			struct dirent **grown = realloc(list, size * sizeof *list);
+			if (!grown)
+				goto error;
+			list = grown;
+		}
+		if (!(d = calloc(1, sizeof *d)))
+			goto error;
+		strcpy(d->d_name, name);
+		if (filter && !filter(d)) {
+			free(d);
+			continue;
+		}
+		list[count++] = d;
+	}
+	free(line);
+	fclose(file);
+	if (compar) {
+		session_scandir_compar = compar;
+		qsort(list, count, sizeof *list, session_scandir_compare);
+	}
+	*namelist = list;
+	return count;
+error:
+	while (count > 0)
+		free(list[--count]);
+	free(list);
+	free(line);
+	fclose(file);
+	return -1;
+}
+
+static int session_comparator(const void *a, const void *b) {
+	const Session *sa = a, *sb = b;
+	if (sa->started != sb->started)
+		return sa->started < sb->started ? -1 : 1;
+	return strcmp(sa->path, sb->path);
 }
 
 static int list_session(void) {
@@ -564,38 +1487,584 @@ static int list_session(void) {
 	if (chdir(sockaddr.sun_path) == -1)
 		die("list-session");
 	struct dirent **namelist;
-	int n = scandir(sockaddr.sun_path, &namelist, session_filter, session_comparator);
+	int n = session_scandir(&namelist, session_filter, NULL);
 	if (n < 0)
 		return 1;
-	printf("Active sessions (on host %s)\n", server.host+1);
-	while (n--) {
-		struct stat sb; char buf[255];
-		if (stat(namelist[n]->d_name, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
-			pid_t pid = 0;
-			strftime(buf, sizeof(buf), "%a%t %F %T", localtime(&sb.st_mtime));
-			char status = ' ';
-			char *local = strstr(namelist[n]->d_name, server.host);
-			if (local) {
-				*local = '\0'; /* truncate hostname if we are local */
-				if (!(pid = session_exists(namelist[n]->d_name)))
-					continue;
-			}
+	Session *sessions = calloc(n, sizeof *sessions);
+	if (n > 0 && !sessions)
+		die("list-session");
+	size_t count = 0;
+	for (int i = 0; i < n; i++) {
+		struct stat sb;
+		Status page;
+		Session *s = &sessions[count];
+		s->path = namelist[i]->d_name;
+		s->status = ' ';
+		if (!SOCKET_ABSTRACT) {
+			if (stat(s->path, &sb) != 0 || !S_ISSOCK(sb.st_mode))
+				continue;
+			s->started = sb.st_mtime;
 			if (sb.st_mode & S_IXUSR)
-				status = '*';
+				s->status = '*';
 			else if (sb.st_mode & S_IXGRP)
-				status = '+';
-			printf("%c %s\t%jd\t%s\n", status, buf, (intmax_t)pid, namelist[n]->d_name);
+				s->status = '+';
+		}
+		if ((s->local = strstr(s->path, server.host))) {
+			switch (session_status(s->path, &page)) {
+			case 1:
+				s->pid = page.pid;
+				s->started = page.started;
+				s->status = page.clients ? '*' : page.exit_status != -1 ? '+' : ' ';
+				break;
+			case -1:
+				session_remove(s->path);
+				continue;
+			case 0:
+				s->probe = true;
+				break;
+			}
+		}
+		count++;
+	}
+	session_probe(sessions, count);
+	qsort(sessions, count, sizeof *sessions, session_comparator);
+	printf("Active sessions (on host %s)\n", server.host+1);
+	for (size_t i = count; i-- > 0;) {
+		char buf[255];
+		Session *s = &sessions[i];
+		if (s->unresponsive)
+			s->status = '?';
+		else if (s->probe && !s->pid)
+			continue;
+		if (s->local)
+			*s->local = '\0'; /* truncate hostname if we are local */
+		strftime(buf, sizeof(buf), "%a%t %F %T", localtime(&s->started));
+		printf("%c %s\t%jd\t%s\n", s->status, buf, (intmax_t)s->pid, s->path);
+	}
+	for (int i = 0; i < n; i++)
+		free(namelist[i]);
+	free(namelist);
+	free(sessions);
+	return 0;
+}
+
+typedef struct {
+	long time;            /* when the sample was taken */
+	Status session;
+	ClientStats *clients;
+} Stats;
+
+static uint64_t stats_rate(uint64_t now, uint64_t before, long ms) {
+	return ms > 0 && now > before ? (now - before) * 1000 / ms : 0;
+}
+
+static void stats_print_session(const char *name, int len, Status *now, Status *before, long ms) {
+	printf("%.*s\t%jd\t%"PRIu32"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%.1f%%\t%"PRIu64"\n", len, name,
+	       (intmax_t)now->pid, now->clients,
+	       stats_rate(now->pty_read, before->pty_read, ms),
+	       stats_rate(now->pty_written, before->pty_written, ms),
+	       stats_rate(now->wakeups, before->wakeups, ms),
+	       ms > 0 ? (now->busy - before->busy) / (10.0 * ms) : 0.0,
+	       now->startup);
+}
+
+static void stats_print_client(ClientStats *now, ClientStats *before, long ms) {
+	static const char *states[] = {
+		[STATE_CONNECTED]    = "connected",
+		[STATE_ATTACHED]     = "attached",
+		[STATE_DETACHED]     = "detached",
+		[STATE_DISCONNECTED] = "disconnected",
+	};
+	char flags[3] = "-", *f = flags;
+	if (now->flags & CLIENT_READONLY)
+		*f++ = 'r';
+	if (now->flags & CLIENT_LOWPRIORITY)
+		*f++ = 'l';
+	printf("%"PRIu32"\t%s\t%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n", now->id,
+	       now->state < countof(states) ? states[now->state] : "unknown", flags,
+	       stats_rate(now->sent, before->sent, ms),
+	       stats_rate(now->packets, before->packets, ms),
+	       stats_rate(now->dropped, before->dropped, ms),
+	       now->queued, now->queue_max);
+}
+
+/* wait for the next packet of the given type, skipping all other output */
+static bool session_receive(int socket, Buffer *buf, Packet *pkt, uint32_t type) {
+	long deadline = server_clock_ms() + PROBE_TIMEOUT;
+	for (;;) {
+		int r = buffer_packet(buf, pkt, PACKET_LEGACY_MAX, NULL);
+		/* the output of a terminated session is still of interest */
+		if (r == 1 && pkt->type == MSG_EXIT && type != MSG_TAIL) {
+			errno = ESRCH;
+			return false;
+		}
+		if (r == -1)
+			return false;
+		if (r == 1 && pkt->type == type)
+			return true;
+		if (r == 1)
+			continue;
+		struct pollfd pfd = { .fd = socket, .events = POLLIN };
+		long timeout = deadline - server_clock_ms();
+		if (timeout > 0 && (r = poll(&pfd, 1, timeout)) == -1 && errno == EINTR)
+			continue;
+		if (timeout <= 0 || r == 0) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+		ssize_t len = buffer_read(buf, socket, sizeof *pkt);
+		if (len == 0 || (len == -1 && errno != EINTR && errno != EAGAIN))
+			return false;
+	}
+}
+
+static bool stats_sample(int socket, Buffer *buf, Stats *stats) {
+	Packet pkt = { .type = MSG_STATS };
+	if (!send_packet(socket, &pkt) || !session_receive(socket, buf, &pkt, MSG_STATS) ||
+	    pkt.len < offsetof(Status, startup) || pkt.len > sizeof pkt.u.status)
+		return false;
+	/* servers predating appended fields report them as zero */
+	memset(&stats->session, 0, sizeof stats->session);
+	memcpy(&stats->session, &pkt.u.status, pkt.len);
+	ClientStats *clients = realloc(stats->clients, MAX(stats->session.clients, 1) * sizeof *clients);
+	if (!clients)
+		return false;
+	stats->clients = clients;
+	for (uint32_t i = 0; i < stats->session.clients; i++) {
+		if (!session_receive(socket, buf, &pkt, MSG_STATS) || pkt.len != sizeof pkt.u.client)
+			return false;
+		clients[i] = pkt.u.client;
+	}
+	stats->time = server_clock_ms();
+	return true;
+}
+
+static int stats_compare(const struct dirent **a, const struct dirent **b) {
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/* read the status pages of all sessions in the socket directory */
+static int stats_pages(struct dirent ***namelist, Status **pages) {
+	int n = session_scandir(namelist, session_filter, stats_compare);
+	if (n < 0 || !(*pages = calloc(MAX(n, 1), sizeof **pages)))
+		die("stats-session");
+	for (int i = 0; i < n; i++) {
+		if (session_status((*namelist)[i]->d_name, &(*pages)[i]) != 1)
+			(*pages)[i].magic = 0;
+	}
+	return n;
+}
+
+/* resident memory of a process in bytes, zero where unknown */
+static uint64_t process_rss(pid_t pid) {
+	uint64_t rss = 0;
+#if defined(__linux__)
+	char path[64];
+	unsigned long size, resident;
+	FILE *file;
+	if (xsnprintf(path, sizeof path, "/proc/%jd/statm", (intmax_t)pid) && (file = fopen(path, "r"))) {
+		if (fscanf(file, "%lu %lu", &size, &resident) == 2)
+			rss = (uint64_t)resident * sysconf(_SC_PAGESIZE);
+		fclose(file);
+	}
+#endif
+	return rss;
+}
+
+/* number of warm sessions per pool and the memory they occupy while idle */
+static void stats_pool(void) {
+	struct dirent **names;
+	int n = session_scandir(&names, pool_filter, stats_compare);
+	if (n <= 0)
+		return;
+	printf("\npool\tsessions\tsize\trss\n");
+	for (int i = 0; i < n;) {
+		/* the slot number follows the last dash */
+		const char *name = names[i]->d_name;
+		int len = strrchr(name, '-') - name, sessions = 0, count = 0, j;
+		pid_t pids[n]; /* of the servers, a daemon is only accounted once */
+		uint64_t rss = 0;
+		for (j = i; j < n && !strncmp(names[j]->d_name, name, len + 1); j++) {
+			Status page;
+			if (session_status(names[j]->d_name, &page) != 1 || page.exit_status != -1)
+				continue;
+			sessions++;
+			rss += process_rss(page.child);
+			int k = 0;
+			while (k < count && pids[k] != page.pid)
+				k++;
+			if (k == count) {
+				pids[count++] = page.pid;
+				rss += process_rss(page.pid);
+			}
+		}
+		printf("%.*s\t%d\t%u\t%"PRIu64"\n", len, name, sessions, POOL_SIZE, rss);
+		for (; i < j; i++)
+			free(names[i]);
+	}
+	free(names);
+}
+
+/* per session rates of all sessions, based on their status pages */
+static int stats_all(long interval) {
+	struct dirent **names[2];
+	Status *pages[2];
+	int count[2];
+	long time[2];
+
+	if (!create_socket_dir(&sockaddr))
+		return 1;
+	if (chdir(sockaddr.sun_path) == -1)
+		die("stats-session");
+	count[0] = stats_pages(&names[0], &pages[0]);
+	time[0] = server_clock_ms();
+
+	for (int cur = 1;; cur = !cur) {
+		int prev = !cur;
+		poll(NULL, 0, interval);
+		count[cur] = stats_pages(&names[cur], &pages[cur]);
+		time[cur] = server_clock_ms();
+		printf("session\tpid\tclients\tread/s\twritten/s\twakeups/s\tbusy\tstartup\n");
+		for (int i = 0, j = 0; i < count[cur]; i++) {
+			const char *name = names[cur][i]->d_name;
+			while (j < count[prev] && strcmp(names[prev][j]->d_name, name) < 0)
+				j++;
+			if (!pages[cur][i].magic || j == count[prev] ||
+			    strcmp(names[prev][j]->d_name, name) || !pages[prev][j].magic)
+				continue;
+			char *local = strstr(name, server.host);
+			int len = local ? local - name : (int)strlen(name);
+			stats_print_session(name, len, &pages[cur][i], &pages[prev][j], time[cur] - time[prev]);
+		}
+		stats_pool();
+		for (int i = 0; i < count[prev]; i++)
+			free(names[prev][i]);
+		free(names[prev]);
+		free(pages[prev]);
+		if (!client.refresh)
+			break;
+		printf("\n");
+		fflush(stdout);
+	}
+	return 0;
+}
+
+/* session and per client rates, requested from the server with MSG_STATS */
+static int stats_session(const char *name) {
+	long interval = client.refresh ? MAX(1000 / client.refresh, 1) : 1000;
+	struct sigaction sa = { .sa_handler = SIG_IGN };
+	sigaction(SIGPIPE, &sa, NULL);
+	if (!name)
+		return stats_all(interval);
+
+	Stats stats[2] = { 0 };
+	Buffer buf = { 0 };
+	int socket = session_connect(name);
+	if (socket == -1 || !stats_sample(socket, &buf, &stats[0]))
+		die("stats-session");
+
+	for (int cur = 1;; cur = !cur) {
+		Stats *now = &stats[cur], *before = &stats[!cur];
+		poll(NULL, 0, interval);
+		if (!stats_sample(socket, &buf, now))
+			die("stats-session");
+		long ms = now->time - before->time;
+		printf("session\tpid\tclients\tread/s\twritten/s\twakeups/s\tbusy\tstartup\n");
+		stats_print_session(name, strlen(name), &now->session, &before->session, ms);
+		printf("client\tstate\tflags\tsent/s\tpackets/s\tdropped/s\tqueued\tqueue-max\n");
+		for (uint32_t i = 0; i < now->session.clients; i++) {
+			ClientStats none = { 0 }, *prev = &none;
+			for (uint32_t j = 0; j < before->session.clients; j++) {
+				if (before->clients[j].id == now->clients[i].id)
+					prev = &before->clients[j];
+			}
+			stats_print_client(&now->clients[i], prev, ms);
 		}
-		free(namelist[n]);
+		if (!client.refresh)
+			break;
+		printf("\n");
+		fflush(stdout);
 	}
+
+	close(socket);
+	buffer_free(&buf);
+	free(stats[0].clients);
+	free(stats[1].clients);
+	return 0;
+}
+
+/* state of a session as last seen by -w */
+typedef struct {
+	char *name;          /* of the session socket */
+	pid_t pid;           /* 0 if unknown */
+	bool attached;
+	bool exited;
+	int exit_status;     /* -1 if unknown */
+} Watch;
+
+static void watch_free(Watch *sessions, int count) {
+	for (int i = 0; i < count; i++)
+		free(sessions[i].name);
+	free(sessions);
+}
+
+/* state of all sessions in the socket directory, sorted by name */
+static int watch_scan(Watch **sessions) {
+	struct dirent **namelist;
+	int n = session_scandir(&namelist, session_filter, stats_compare);
+	if (n < 0)
+		return -1;
+	Watch *list = calloc(MAX(n, 1), sizeof *list);
+	if (!list)
+		die("watch-session");
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		struct stat sb;
+		Status page;
+		Watch *w = &list[count];
+		const char *name = namelist[i]->d_name;
+		switch (session_status(name, &page)) {
+		case 1:
+			w->pid = page.pid;
+			w->attached = page.clients > 0;
+			w->exited = page.exit_status != -1;
+			w->exit_status = page.exit_status;
+			break;
+		case -1:
+			continue;
+		case 0:
+			/* The server predates the pages or is about to write one, it
+			 * is then notified once it did. Older servers are reported upon
+			 * the next rescan. */
+			if (SOCKET_ABSTRACT || stat(name, &sb) != 0 || !S_ISSOCK(sb.st_mode) ||
+			    sb.st_mtime >= time(NULL) - 1)
+				continue;
+			w->attached = sb.st_mode & S_IXUSR;
+			w->exited = sb.st_mode & S_IXGRP;
+			w->exit_status = -1;
+			break;
+		}
+		if (!(w->name = strdup(name)))
+			die("watch-session");
+		count++;
+	}
+	for (int i = 0; i < n; i++)
+		free(namelist[i]);
 	free(namelist);
+	*sessions = list;
+	return count;
+}
+
+static void watch_print(const char *event, const Watch *w) {
+	char buf[32];
+	time_t now = time(NULL);
+	const char *local = strstr(w->name, server.host);
+	int len = local ? (int)(local - w->name) : (int)strlen(w->name);
+	strftime(buf, sizeof(buf), "%F %T", localtime(&now));
+	printf("%-6s %s\t%jd\t%.*s", event, buf, (intmax_t)w->pid, len, w->name);
+	if (!strcmp(event, "exit") && w->exit_status != -1)
+		printf("\t%d", w->exit_status);
+	putchar('\n');
+}
+
+/* print the events which lead from one state of the socket directory to the next */
+static void watch_report(Watch *before, int before_count, Watch *now, int now_count) {
+	static const Watch none = { .exit_status = -1 };
+	int i = 0, j = 0;
+	while (i < before_count || j < now_count) {
+		int cmp = i == before_count ? 1 : j == now_count ? -1 : strcmp(before[i].name, now[j].name);
+		if (cmp < 0) {
+			watch_print("remove", &before[i++]);
+			continue;
+		}
+		const Watch *b = &none, *w = &now[j++];
+		if (cmp == 0)
+			b = &before[i++];
+		/* the name was taken by another session in the meantime */
+		if (b != &none && b->pid && w->pid && b->pid != w->pid) {
+			watch_print("remove", b);
+			b = &none;
+		}
+		if (b == &none)
+			watch_print("add", w);
+		if (w->attached != b->attached)
+			watch_print(w->attached ? "attach" : "detach", w);
+		if (w->exited && !b->exited)
+			watch_print("exit", w);
+	}
+}
+
+/* List the sessions and then report their changes as they happen. On Linux
+ * the socket directory is watched, the servers touch the status pages and
+ * change the mode of the sockets whenever a client attaches or detaches and
+ * when the command terminates. The directory is rescanned at least every
+ * WATCH_INTERVAL milliseconds, to notice servers which were killed. */
+static int watch_session(void) {
+	if (!create_socket_dir(&sockaddr))
+		return 1;
+	if (chdir(sockaddr.sun_path) == -1)
+		die("watch-session");
+	int fd = -1;
+#if defined(__linux__)
+	fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (fd != -1 && inotify_add_watch(fd, ".", IN_CREATE|IN_DELETE|IN_ATTRIB|IN_CLOSE_WRITE|
+	                                  IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR) == -1) {
+		close(fd);
+		fd = -1;
+	}
+#endif
+	/* taken before the listing, changes in between are reported twice rather than never */
+	Watch *sessions;
+	int count = watch_scan(&sessions);
+	if (count < 0 || list_session() != 0 || fflush(stdout) == EOF)
+		return 1;
+	for (;;) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, WATCH_INTERVAL) == -1 && errno != EINTR)
+			die("watch-session");
+		if (pfd.revents) {
+			/* the events only tell that something changed */
+			char buf[4096];
+			while (read(fd, buf, sizeof buf) > 0);
+		}
+		Watch *now;
+		int n = watch_scan(&now);
+		if (n < 0)
+			continue;
+		watch_report(sessions, count, now, n);
+		watch_free(sessions, count);
+		sessions = now;
+		count = n;
+		if (fflush(stdout) == EOF)
+			return 1;
+	}
+}
+
+/* print the last len bytes of output of a session, all it kept if zero,
+ * without attaching to it */
+static int tail_session(const char *name, uint64_t len) {
+	Buffer buf = { 0 };
+	Packet pkt = { .type = MSG_TAIL, .len = sizeof pkt.u.l, .u.l = len };
+	int socket = session_connect(name);
+	if (socket == -1 || !send_packet(socket, &pkt) || !session_receive(socket, &buf, &pkt, MSG_TAIL))
+		die("tail-session");
+	/* the raw output follows the reply */
+	for (uint64_t left = pkt.u.l; left > 0;) {
+		ssize_t r = 0;
+		if (!buffer_len(&buf) && (r = buffer_read(&buf, socket, MIN(left, CLIENT_READ_SIZE))) <= 0) {
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r == 0)
+				errno = ECONNRESET;
+			die("tail-session");
+		}
+		size_t n = MIN(buffer_len(&buf), left);
+		if (write_all(STDOUT_FILENO, buf.data + buf.start, n) == -1)
+			die("tail-session");
+		buffer_consume(&buf, n);
+		left -= n;
+	}
+	close(socket);
+	buffer_free(&buf);
 	return 0;
 }
 
+/* Name of a pool slot, pools are kept per command, working directory and
+ * environment such that a warm session runs exactly as a newly created one
+ * would, except for the session variables naming the slot. */
+static bool pool_name(char *buf, size_t size, char * const argv[], unsigned int slot) {
+	char cwd[PATH_MAX];
+	uint32_t hash = 2166136261u; /* FNV-1a */
+	for (; *argv; argv++) {
+		for (const char *c = *argv; ; c++) {
+			hash = (hash ^ (unsigned char)*c) * 16777619u;
+			if (!*c)
+				break;
+		}
+	}
+	for (const char *c = getcwd(cwd, sizeof cwd); c && *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	for (char **env = environ; *env; env++) {
+		if (!strncmp(*env, "ABDUCO_SESSION=", 15) || !strncmp(*env, "ABDUCO_SOCKET=", 14))
+			continue;
+		for (const char *c = *env; ; c++) {
+			hash = (hash ^ (unsigned char)*c) * 16777619u;
+			if (!*c)
+				break;
+		}
+	}
+	return xsnprintf(buf, size, POOL_PREFIX "%08"PRIx32"-%u", hash, slot);
+}
+
+/* Have a warm session of the pool move to the name of the session about to
+ * be created. The server binds the new socket before removing the old one,
+ * such that a claim fails if the name is taken and only one of concurrent
+ * claims of the same session succeeds. */
+static bool pool_claim(const char *name, char * const argv[]) {
+	char path[sizeof(sockaddr.sun_path)], slot[64];
+	Buffer buf = { 0 };
+	bool claimed = false;
+
+	if (!POOL_SIZE || session_exists(name) || !xsnprintf(path, sizeof path, "%s", sockaddr.sun_path))
+		return false;
+	for (unsigned int i = 0; i < POOL_SIZE && !claimed; i++) {
+		Status page;
+		Packet pkt = { .type = MSG_CLAIM, .len = strlen(path) };
+		if (!pool_name(slot, sizeof slot, argv, i) || !set_socket_name(&sockaddr, slot) ||
+		    session_status(sockaddr.sun_path, &page) != 1 || page.clients || page.exit_status != -1)
+			continue;
+		int fd = session_connect(slot);
+		if (fd == -1)
+			continue;
+		memcpy(pkt.u.msg, path, pkt.len);
+		claimed = send_packet(fd, &pkt) && session_receive(fd, &buf, &pkt, MSG_CLAIM) && pkt.len == 0;
+		buf.start = buf.end = 0;
+		close(fd);
+	}
+	buffer_free(&buf);
+	set_socket_name(&sockaddr, name);
+	return claimed;
+}
+
+/* Start warm sessions for all free slots of the pool from a detached process,
+ * the caller does not wait for them. */
+static void pool_fill(char * const argv[]) {
+	char slot[64];
+	pid_t pid = fork();
+	if (pid == -1)
+		return;
+	if (pid > 0) {
+		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
+		return;
+	}
+	setsid();
+	if (fork() != 0)
+		_exit(EXIT_SUCCESS);
+	int fd = open("/dev/null", O_RDWR);
+	if (fd != -1) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	/* nobody is attached to consume the output */
+	server.read_pty = true;
+	for (unsigned int i = 0; i < POOL_SIZE; i++) {
+		if (!pool_name(slot, sizeof slot, argv, i) || session_exists(slot) ||
+		    !create_session(slot, argv))
+			continue;
+		if (server.socket > 0)
+			close(server.socket);
+		server.socket = 0;
+	}
+	_exit(EXIT_SUCCESS);
+}
+
 int main(int argc, char *argv[]) {
 	int opt;
-	bool force = false;
-	char **cmd = NULL, action = '\0';
+	bool force = false, pool = false;
+	char **cmd = NULL, action = '\0', *record = NULL;
 
 	char *default_cmd[4] = { "/bin/sh", "-c", getenv("ABDUCO_CMD"), NULL };
 	if (!default_cmd[2]) {
@@ -603,15 +2072,29 @@ int main(int argc, char *argv[]) {
 		default_cmd[1] = NULL;
 	}
 
+	if (getenv("ABDUCO_POOL"))
+		POOL_SIZE = MAX(atoi(getenv("ABDUCO_POOL")), 0);
+#if defined(__linux__)
+	if (getenv("ABDUCO_ABSTRACT"))
+		SOCKET_ABSTRACT = atoi(getenv("ABDUCO_ABSTRACT")) != 0;
+#else
+	SOCKET_ABSTRACT = false;
+#endif
+
+	setlocale(LC_CTYPE, "");
 	server.name = basename(argv[0]);
 	gethostname(server.host+1, sizeof(server.host) - 1);
 
-	while ((opt = getopt(argc, argv, "aAclne:fpqrv")) != -1) {
+	while ((opt = getopt(argc, argv, "aAclne:fDL:o:pPqrR:StvwW")) != -1) {
 		switch (opt) {
 		case 'a':
 		case 'A':
 		case 'c':
 		case 'n':
+		case 'P':
+		case 'S':
+		case 't':
+		case 'w':
 			action = opt;
 			break;
 		case 'e':
@@ -624,6 +2107,19 @@ int main(int argc, char *argv[]) {
 		case 'f':
 			force = true;
 			break;
+		case 'D':
+			SESSION_DAEMON = true;
+			break;
+		case 'L':
+			if (atoi(optarg) <= 0)
+				usage();
+			latency.count = atoi(optarg);
+			break;
+		case 'o':
+			if (atoi(optarg) <= 0)
+				usage();
+			client.refresh = atoi(optarg);
+			break;
 		case 'p':
 			passthrough = true;
 			break;
@@ -633,9 +2129,15 @@ int main(int argc, char *argv[]) {
 		case 'r':
 			client.flags |= CLIENT_READONLY;
 			break;
+		case 'R':
+			record = optarg;
+			break;
 		case 'l':
 			client.flags |= CLIENT_LOWPRIORITY;
 			break;
+		case 'W':
+			pool = true;
+			break;
 		case 'v':
 			puts("abduco-"VERSION" © 2013-2018 Marc André Tanner");
 			exit(EXIT_SUCCESS);
@@ -666,10 +2168,16 @@ int main(int argc, char *argv[]) {
 
 	if (!action && !server.session_name)
 		exit(list_session());
+	if (action == 'S')
+		exit(stats_session(server.session_name));
+	if (action == 'w')
+		exit(watch_session());
+	if (action == 't' && server.session_name)
+		exit(tail_session(server.session_name, cmd != default_cmd ? strtoull(cmd[0], NULL, 10) : 0));
 	if (!action || !server.session_name)
 		usage();
 
-	if (!passthrough && tcgetattr(STDIN_FILENO, &orig_term) != -1) {
+	if (!passthrough && !latency.count && tcgetattr(STDIN_FILENO, &orig_term) != -1) {
 		server.term = orig_term;
 		has_term = true;
 	}
@@ -679,6 +2187,10 @@ int main(int argc, char *argv[]) {
 		server.winsize.ws_row = 25;
 	}
 
+	if (action == 'P')
+		exit(replay_session(server.session_name, cmd != default_cmd ? atof(cmd[0]) : 1,
+		                    cmd != default_cmd && cmd[1] ? atof(cmd[1]) : 0));
+
 	server.read_pty = (action == 'n');
 
 	redo:
@@ -693,8 +2205,21 @@ int main(int argc, char *argv[]) {
 			if (session_exists(server.session_name))
 				attach_session(server.session_name, false);
 		}
-		if (!create_session(server.session_name, cmd))
+		if (record && (server.record_fd = record_open(record, &server.record_flags)) == -1)
+			die("record-open");
+		/* only commands marked as such are pooled, warm sessions were not recorded */
+		if (pool && POOL_SIZE && !record) {
+			if (!pool_claim(server.session_name, cmd) && !create_session(server.session_name, cmd))
+				die("create-session");
+			pool_fill(cmd);
+		} else if (!create_session(server.session_name, cmd)) {
 			die("create-session");
+		}
+		/* the server holds on to the recording */
+		if (server.record_fd > 0) {
+			close(server.record_fd);
+			server.record_fd = 0;
+		}
 		if (action == 'n')
 			break;
 		/* fall through */
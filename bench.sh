@@ -0,0 +1,217 @@
+#!/bin/sh
+# Performance benchmarks, results are printed as tab separated lines of
+#
+#   name	value	unit
+#
+# Only local processes are used, but script(1) and a date(1) supporting
+# nanoseconds (%N) are required. All sessions live in a temporary socket
+# directory and are killed upon completion.
+
+ABDUCO="./abduco"
+
+[ ! -z "$1" ] && ABDUCO="$1"
+[ ! -x "$ABDUCO" ] && echo "usage: $0 /path/to/abduco" && exit 1
+
+BENCH_BYTES=${BENCH_BYTES:-100000000}
+BENCH_FANOUT=${BENCH_FANOUT:-"1 10 100 1000"}
+BENCH_FANOUT_BYTES=${BENCH_FANOUT_BYTES:-20000000}
+BENCH_SESSIONS=${BENCH_SESSIONS:-100}
+BENCH_RUNS=${BENCH_RUNS:-5}
+BENCH_SAMPLES=${BENCH_SAMPLES:-1000}
+BENCH_TIMEOUT=${BENCH_TIMEOUT:-60}
+
+# $1 => bytes of output, without line breaks
+output() {
+	echo "head -c $1 /dev/zero | tr '\\0' y"
+}
+
+ABDUCO_SOCKET_DIR="$(mktemp -d)" || exit 1
+export ABDUCO_SOCKET_DIR
+DIR="$ABDUCO_SOCKET_DIR"
+# never written to, keeps the standard input of clients open
+FIFO="$DIR/input"
+mkfifo "$FIFO" || exit 1
+sleep 1000000 > "$FIFO" &
+HOLD=$!
+
+if script -qec true /dev/null < /dev/null > /dev/null 2>&1; then
+	tty_run() { script -qec "$1" /dev/null; }
+else
+	tty_run() { script -q /dev/null sh -c "$1"; }
+fi
+
+now() {
+	date +%s%N
+}
+
+result() {
+	printf "%s\t%s\t%s\n" "$1" "$2" "$3"
+}
+
+# $1 => start, $2 => end in nanoseconds
+elapsed_ms() {
+	echo "$1 $2" | awk '{ printf "%.1f\n", ($2 - $1) / 1e6 }'
+}
+
+# $1 => bytes, $2 => start, $3 => end in nanoseconds
+rate_mb() {
+	echo "$1 $2 $3" | awk '{ printf "%.1f", $1 / 1e6 / (($3 - $2) / 1e9) }'
+}
+
+median() {
+	sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+# $1 => pid, prints the CPU time it consumed in clock ticks (Linux only)
+cpu_ticks() {
+	awk '{ print $14 + $15 }' "/proc/$1/stat" 2>/dev/null
+}
+
+session_pids() {
+	$ABDUCO | awk 'NR > 1 { print $(NF-1) }'
+}
+
+# $1 => session-name, $2 => column of its line in the statistics
+session_stat() {
+	$ABDUCO -S | awk -v name="$1" -v col="$2" '$1 == name { print $col }'
+}
+
+# $1 => session-name, $2 => number of clients to wait for, fails after
+# BENCH_TIMEOUT seconds
+wait_clients() {
+	local deadline=$(($(date +%s) + BENCH_TIMEOUT))
+	while [ "$(session_stat "$1" 3)" != "$2" ]; do
+		if [ $(date +%s) -ge $deadline ]; then
+			echo "$1: $(session_stat "$1" 3) of $2 clients connected after ${BENCH_TIMEOUT}s" >&2
+			return 1
+		fi
+		sleep 0.1
+	done
+}
+
+kill_sessions() {
+	for pid in $(session_pids); do
+		kill $pid 2>/dev/null
+	done
+	while [ "$(session_pids)" ]; do
+		sleep 0.1
+	done
+}
+
+cleanup() {
+	kill_sessions
+	kill $HOLD 2>/dev/null
+	rm -rf "$DIR"
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# pty to client throughput of an attached client
+bench_throughput() {
+	local start=$(now)
+	tty_run "$ABDUCO -c tput sh -c \"$(output $BENCH_BYTES)\"" < "$FIFO" > /dev/null 2>&1
+	result throughput "$(rate_mb $BENCH_BYTES $start $(now))" MB/s
+}
+
+# pty throughput with $1 read-only observers attached
+bench_fanout() {
+	local n=$1
+	$ABDUCO -n "fanout" sh -c "while [ ! -e '$DIR/go' ]; do sleep 0.1; done;
+		$(output $BENCH_FANOUT_BYTES); date +%s%N > '$DIR/done'" ||
+		return 1
+	local i=0
+	while [ $i -lt $n ]; do
+		$ABDUCO -r -a fanout < "$FIFO" > /dev/null 2>&1 &
+		i=$((i + 1))
+	done
+	if ! wait_clients fanout $n; then
+		kill_sessions
+		return 1
+	fi
+	local pid=$(session_pids)
+	local cpu=$(cpu_ticks $pid)
+	local start=$(now)
+	: > "$DIR/go"
+	while [ ! -s "$DIR/done" ]; do
+		sleep 0.05
+	done
+	result "fanout_$n" "$(rate_mb $BENCH_FANOUT_BYTES $start $(cat "$DIR/done"))" MB/s
+	# server CPU time per MB of output
+	[ "$cpu" ] && result "fanout_${n}_cpu" "$(echo "$cpu $(cpu_ticks $pid) $(getconf CLK_TCK)" |
+		awk '{ printf "%.2f", ($2 - $1) * 1000 / $3 / ('$BENCH_FANOUT_BYTES' / 1e6) }')" ms/MB
+	rm -f "$DIR/go" "$DIR/done"
+	kill_sessions
+}
+
+# time until output of a newly created session arrives at the client
+bench_first_byte() {
+	local i=0
+	while [ $i -lt $BENCH_RUNS ]; do
+		local start=$(now)
+		tty_run "$ABDUCO -c first sh -c 'while :; do echo tick; sleep 0.05; done'" < "$FIFO" 2>/dev/null |
+			{ grep -m1 tick > /dev/null; now > "$DIR/first"; kill_sessions; }
+		elapsed_ms $start $(cat "$DIR/first")
+		i=$((i + 1))
+	done | median | { read ms; result first_byte $ms ms; }
+}
+
+# time until an attaching client is sent the screen content
+bench_attach() {
+	local i=0
+	while [ $i -lt $BENCH_RUNS ]; do
+		$ABDUCO -n attach sh -c 'while :; do echo tick; sleep 0.05; done' || return 1
+		sleep 0.2
+		local start=$(now)
+		tty_run "$ABDUCO -a attach" < "$FIFO" 2>/dev/null |
+			{ grep -m1 tick > /dev/null; now > "$DIR/attach"; kill_sessions; }
+		elapsed_ms $start $(cat "$DIR/attach")
+		i=$((i + 1))
+	done | median | { read ms; result attach $ms ms; }
+}
+
+# keystroke to echo latency against cat(1)
+bench_latency() {
+	$ABDUCO -n latency cat || return 1
+	$ABDUCO -L $BENCH_SAMPLES -a latency < "$FIFO" |
+		awk '$1 == "total" { print "latency_p50\t" $3 "\tus"; print "latency_p99\t" $4 "\tus" }'
+	kill_sessions
+}
+
+# creation latency, listing time and server memory usage with many sessions
+bench_sessions() {
+	local i=0 start=$(now)
+	while [ $i -lt $BENCH_SESSIONS ]; do
+		$ABDUCO -n "session$i" sleep 1000000 || return 1
+		i=$((i + 1))
+	done
+	echo "$start $(now) $BENCH_SESSIONS" |
+		awk '{ printf "create\t%.2f\tms\n", ($2 - $1) / 1e6 / $3 }'
+	# as measured by the servers, from the creation request until serving
+	$ABDUCO -S | awk '$1 ~ /^session[0-9]/ { print $8 }' | median | { read us; result startup "$us" us; }
+	i=0
+	while [ $i -lt $BENCH_RUNS ]; do
+		local start=$(now)
+		$ABDUCO > /dev/null
+		elapsed_ms $start $(now)
+		i=$((i + 1))
+	done | median | { read ms; result "list_$BENCH_SESSIONS" $ms ms; }
+	for pid in $(session_pids); do
+		awk '/^VmRSS:/ { print $2 }' /proc/$pid/status 2>/dev/null
+	done | median | { read kb; result session_rss "$kb" KiB; }
+	# memory not shared with other processes, divided among the sessions a
+	# server hosts such that it is comparable with sessions hosted by a daemon
+	for pid in $(session_pids | sort -u); do
+		awk '/^Private_(Clean|Dirty):/ { kb += $2 } END { print kb }' /proc/$pid/smaps_rollup 2>/dev/null
+	done | awk '{ kb += $1 } END { if (NR) printf "session_private\t%d\tKiB\n", kb / '$BENCH_SESSIONS' }'
+	kill_sessions
+}
+
+bench_throughput
+for n in $BENCH_FANOUT; do
+	bench_fanout $n
+done
+bench_first_byte
+bench_attach
+bench_latency
+bench_sessions
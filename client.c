@@ -1,26 +1,174 @@
+enum { LATENCY_TOTAL, LATENCY_CLIENT, LATENCY_SERVER, LATENCY_APPLICATION, LATENCY_PARTS };
+
+/* state of the keystroke to echo latency measurement (-L) */
+static struct {
+	unsigned int count;      /* samples to take, zero if not measuring */
+	unsigned int probes;     /* keystrokes sent so far */
+	unsigned int lost;       /* keystrokes without echo within PROBE_TIMEOUT */
+	uint64_t sent_at;        /* of the outstanding keystroke, zero if none */
+	uint64_t next_at;        /* earliest time for the next keystroke */
+	bool timed;              /* server timestamps for the outstanding keystroke arrived */
+	Packet timing;
+	uint64_t *samples[LATENCY_PARTS];
+	unsigned int taken[LATENCY_PARTS];
+} latency;
+
 static void client_sigwinch_handler(int sig) {
 	client.need_resize = true;
 }
 
-static bool client_send_packet(Packet *pkt) {
-	print_packet("client-send:", pkt);
-	if (send_packet(server.socket, pkt))
-		return true;
-	debug("FAILED\n");
+/* packets not yet accepted by the socket, no further input is read meanwhile
+ * such that the output of the server keeps being consumed */
+static Buffer client_input;
+
+/* write out pending packets, waiting for the server to take all of them if block is set */
+static bool client_send_input(bool block) {
+	Buffer *buf = &client_input;
+	while (buffer_len(buf)) {
+		ssize_t len = write(server.socket, buf->data + buf->start, buffer_len(buf));
+		if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (!block)
+				return true;
+			struct pollfd pfd = { .fd = server.socket, .events = POLLOUT };
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			goto error;
+		buffer_consume(buf, len);
+	}
+	return true;
+error:
+	debug("client-send: FAILED\n");
+	server.running = false;
+	return false;
+}
+
+/* send what the socket accepts right away and keep the rest pending */
+static bool client_send(uint32_t type, const char *data, size_t len) {
+	uint32_t header[16][2];
+	struct iovec iov[2*countof(header)];
+	do {
+		int count = packet_iovec(header, countof(header), iov, type, &data, &len, client.packet_max);
+		ssize_t n = 0;
+		if (!buffer_len(&client_input))
+			n = writev(server.socket, iov, count);
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			goto error;
+		struct iovec *rest = iov;
+		count = iovec_advance(&rest, count, MAX(n, 0));
+		for (int i = 0; i < count; i++) {
+			if (!buffer_append(&client_input, rest[i].iov_base, rest[i].iov_len))
+				goto error;
+		}
+	} while (len > 0);
+	return true;
+error:
+	debug("client-send: FAILED\n");
 	server.running = false;
 	return false;
 }
 
-static bool client_recv_packet(Packet *pkt) {
-	if (recv_packet(server.socket, pkt)) {
+static bool client_send_packet(Packet *pkt) {
+	print_packet("client-send:", pkt);
+	return client_send(pkt->type, pkt->u.msg, pkt->len);
+}
+
+static void client_read_server(void) {
+	ssize_t len = buffer_read(&client.input, server.socket, CLIENT_READ_SIZE);
+	if (len == 0 || (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		debug("client-recv: FAILED\n");
+		server.running = false;
+	}
+}
+
+static bool client_recv_packet(Packet *pkt, const char **payload) {
+	switch (buffer_packet(&client.input, pkt, PACKET_MAX, payload)) {
+	case 1:
 		print_packet("client-recv:", pkt);
 		return true;
+	case -1:
+		debug("client-recv: FAILED\n");
+		server.running = false;
 	}
-	debug("client-recv: FAILED\n");
-	server.running = false;
 	return false;
 }
 
+/* content received in one go, written to the terminal at once */
+static Buffer client_output;
+
+static void client_flush_output(void) {
+	Buffer *buf = &client_output;
+	write_all(STDOUT_FILENO, buf->data + buf->start, buffer_len(buf));
+	buf->start = buf->end = 0;
+}
+
+/* type a character or erase it again, returns the microseconds until the next action */
+static uint64_t client_latency_probe(void) {
+	uint64_t now = clock_us(), timeout = PROBE_TIMEOUT * 1000ULL;
+	if (latency.sent_at && now - latency.sent_at >= timeout) {
+		latency.lost++;
+		latency.sent_at = 0;
+	}
+	if (latency.sent_at)
+		return latency.sent_at + timeout - now;
+	if (now < latency.next_at)
+		return latency.next_at - now;
+	char key = latency.probes++ % 2 ? '\177' : 'x';
+	latency.timed = false;
+	latency.sent_at = now;
+	client_send(MSG_CONTENT, &key, 1);
+	return timeout;
+}
+
+static void client_latency_sample(int part, uint64_t value) {
+	latency.samples[part][latency.taken[part]++] = value;
+}
+
+/* the first output after a keystroke is taken as its echo */
+static void client_latency_echo(void) {
+	if (!latency.sent_at)
+		return;
+	uint64_t now = clock_us(), sent = latency.sent_at;
+	client_latency_sample(LATENCY_TOTAL, now - sent);
+	if (latency.timed && latency.timing.u.timing.received >= sent) {
+		Packet *t = &latency.timing;
+		client_latency_sample(LATENCY_CLIENT, (t->u.timing.received - sent) + (now - t->u.timing.sent));
+		client_latency_sample(LATENCY_SERVER, (t->u.timing.written - t->u.timing.received) +
+		                                      (t->u.timing.sent - t->u.timing.read));
+		client_latency_sample(LATENCY_APPLICATION, t->u.timing.read - t->u.timing.written);
+	}
+	latency.sent_at = 0;
+	latency.next_at = now + LATENCY_INTERVAL * 1000ULL;
+}
+
+static int client_latency_compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void client_latency_report(void) {
+	static const char *parts[] = {
+		[LATENCY_TOTAL]       = "total",
+		[LATENCY_CLIENT]      = "client",
+		[LATENCY_SERVER]      = "server",
+		[LATENCY_APPLICATION] = "application",
+	};
+	printf("latency\tsamples\tp50\tp99\tmax\n");
+	for (int i = 0; i < LATENCY_PARTS; i++) {
+		unsigned int n = latency.taken[i];
+		uint64_t *s = latency.samples[i];
+		qsort(s, n, sizeof *s, client_latency_compare);
+		printf("%s\t%u\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n", parts[i], n,
+		       n ? s[(n-1)*50/100] : 0, n ? s[(n-1)*99/100] : 0, n ? s[n-1] : 0);
+	}
+	fflush(stdout);
+	if (latency.lost)
+		info("%u keystrokes without echo", latency.lost);
+}
+
 static void client_restore_terminal(void) {
 	if (!has_term)
 		return;
@@ -63,18 +211,38 @@ static int client_mainloop(void) {
 	sigprocmask(SIG_BLOCK, &blockset, NULL);
 
 	client.need_resize = true;
+	client.packet_max = PACKET_LEGACY_MAX;
+	Packet hello = {
+		.type = MSG_HELLO,
+		.u.hello = {
+			.version = PROTOCOL_VERSION,
+			.max = PACKET_MAX,
+			.caps = latency.count ? CAP_TIMESTAMPS : 0,
+		},
+		.len = sizeof(hello.u.hello),
+	};
+	for (int i = 0; latency.count && i < LATENCY_PARTS; i++) {
+		if (!(latency.samples[i] = calloc(latency.count, sizeof(uint64_t))))
+			die("client-latency");
+	}
+	latency.next_at = clock_us() + LATENCY_INTERVAL * 1000ULL;
+	client_send_packet(&hello);
 	Packet pkt = {
 		.type = MSG_ATTACH,
-		.u.i = client.flags,
-		.len = sizeof(pkt.u.i),
+		.u.attach = { .flags = client.flags, .refresh = client.refresh },
+		.len = sizeof(pkt.u.attach),
 	};
 	client_send_packet(&pkt);
 
 	while (server.running) {
-		fd_set fds;
+		fd_set fds, wfds;
 		FD_ZERO(&fds);
-		FD_SET(STDIN_FILENO, &fds);
+		FD_ZERO(&wfds);
+		if (!latency.count && !buffer_len(&client_input))
+			FD_SET(STDIN_FILENO, &fds);
 		FD_SET(server.socket, &fds);
+		if (buffer_len(&client_input))
+			FD_SET(server.socket, &wfds);
 
 		if (client.need_resize) {
 			struct winsize ws;
@@ -89,49 +257,93 @@ static int client_mainloop(void) {
 			}
 		}
 
-		if (pselect(server.socket+1, &fds, NULL, NULL, NULL, &emptyset) == -1) {
+		struct timespec *timeout = NULL, wait;
+		if (latency.count && latency.taken[LATENCY_TOTAL] == latency.count) {
+			client_latency_report();
+			Packet pkt = { .type = MSG_DETACH, .len = 0 };
+			client_send_packet(&pkt);
+			close(server.socket);
+			return -1;
+		} else if (latency.count) {
+			uint64_t us = client_latency_probe();
+			wait = (struct timespec){ .tv_sec = us / 1000000, .tv_nsec = us % 1000000 * 1000 };
+			timeout = &wait;
+		}
+
+		if (pselect(server.socket+1, &fds, &wfds, NULL, timeout, &emptyset) == -1) {
 			if (errno == EINTR)
 				continue;
 			die("client-mainloop");
 		}
 
+		if (FD_ISSET(server.socket, &wfds))
+			client_send_input(false);
+
 		if (FD_ISSET(server.socket, &fds)) {
 			Packet pkt;
-			if (client_recv_packet(&pkt)) {
+			const char *payload;
+			client_read_server();
+			while (client_recv_packet(&pkt, &payload)) {
 				switch (pkt.type) {
 				case MSG_CONTENT:
-					if (!passthrough)
-						write_all(STDOUT_FILENO, pkt.u.msg, pkt.len);
+					if (latency.count)
+						client_latency_echo();
+					if (passthrough || latency.count)
+						break;
+					if (!buffer_append(&client_output, payload, pkt.len)) {
+						client_flush_output();
+						write_all(STDOUT_FILENO, payload, pkt.len);
+					}
+					break;
+				case MSG_HELLO:
+					/* the server does not reply if it predates MSG_HELLO */
+					client.packet_max = MAX(MIN(pkt.u.hello.max, PACKET_MAX), PACKET_LEGACY_MAX);
 					break;
 				case MSG_RESIZE:
 					client.need_resize = true;
 					break;
+				case MSG_TIMING:
+					latency.timing = pkt;
+					latency.timed = true;
+					break;
 				case MSG_EXIT:
-					client_send_packet(&pkt);
+					client_flush_output();
+					/* the server discards further input of a terminated session */
+					if (client_send_packet(&pkt))
+						client_send_input(true);
 					close(server.socket);
 					return pkt.u.i;
 				}
 			}
+			client_flush_output();
 		}
 
 		if (FD_ISSET(STDIN_FILENO, &fds)) {
-			Packet pkt = { .type = MSG_CONTENT };
-			ssize_t len = read(STDIN_FILENO, pkt.u.msg, sizeof(pkt.u.msg));
+			static char buf[PACKET_MAX];
+			ssize_t len = read(STDIN_FILENO, buf, client.packet_max);
 			if (len == -1 && errno != EAGAIN && errno != EINTR)
 				die("client-stdin");
+			/* more than a few keystrokes, gather the rest of the paste into one packet */
+			while (len >= CLIENT_PASTE_MIN && len < client.packet_max) {
+				struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+				if (poll(&pfd, 1, 0) != 1)
+					break;
+				ssize_t n = read(STDIN_FILENO, buf + len, client.packet_max - len);
+				if (n <= 0)
+					break;
+				len += n;
+			}
 			if (len > 0) {
-				debug("client-stdin: %c\n", pkt.u.msg[0]);
-				pkt.len = len;
-				if (KEY_REDRAW && pkt.u.msg[0] == KEY_REDRAW) {
+				debug("client-stdin: %c\n", buf[0]);
+				if (KEY_REDRAW && buf[0] == KEY_REDRAW) {
 					client.need_resize = true;
-				} else if (pkt.u.msg[0] == KEY_DETACH) {
-					pkt.type = MSG_DETACH;
-					pkt.len = 0;
+				} else if (buf[0] == KEY_DETACH) {
+					Packet pkt = { .type = MSG_DETACH, .len = 0 };
 					client_send_packet(&pkt);
 					close(server.socket);
 					return -1;
 				} else if (!(client.flags & CLIENT_READONLY)) {
-					client_send_packet(&pkt);
+					client_send(MSG_CONTENT, buf, len);
 				}
 			} else if (len == 0) {
 				debug("client-stdin: EOF\n");
@@ -17,3 +17,68 @@ static struct Dir {
 	{ .env  = "TMPDIR",            false },
 	{ .path = "/tmp",              false },
 };
+/* Linux only: bind the sessions in the abstract namespace under the names their
+ * sockets would have in the directory, which then only holds the status pages.
+ * Only processes of the same user are talked to. Can be enabled at run time
+ * by setting $ABDUCO_ABSTRACT, has to be set alike for all invocations. */
+static bool SOCKET_ABSTRACT = false;
+/* Output which can not immediately be written to a client is queued. Once more
+ * than QUEUE_HIGH bytes are pending, the overflow policy applies until the queue
+ * drained below QUEUE_LOW bytes. Possible policies are:
+ *
+ *  OVERFLOW_BLOCK       stop reading from the pty (i.e. apply backpressure)
+ *  OVERFLOW_DROP        discard output for this client, it is repainted
+ *                       once it caught up
+ *  OVERFLOW_DISCONNECT  disconnect the client
+ *
+ * With OVERFLOW_BLOCK a single client which stopped reading, e.g. a suspended
+ * ssh connection, holds up the session for all others.
+ */
+static size_t QUEUE_LOW = 64 * 1024;
+static size_t QUEUE_HIGH = 1024 * 1024;
+static enum Overflow QUEUE_OVERFLOW = OVERFLOW_DROP;
+/* policy for clients attached with -l (and -p) */
+static enum Overflow QUEUE_OVERFLOW_LOWPRIORITY = OVERFLOW_DROP;
+/* Each wakeup the pty is drained into a batch which is then forwarded to all
+ * clients at once. The batch grows from PTY_BATCH_MIN up to PTY_BATCH_MAX bytes
+ * while the application keeps it filled, and stops early after PTY_BATCH_TIME
+ * milliseconds to keep input latency bounded. */
+static size_t PTY_BATCH_MIN = 4096;
+static size_t PTY_BATCH_MAX = 256 * 1024;
+static int PTY_BATCH_TIME = 5;
+/* maximal amount of data a client reads from the server at once, all content
+ * contained therein is written to the terminal with a single write(2) */
+static size_t CLIENT_READ_SIZE = 64 * 1024;
+/* reads from the terminal of at least this size are taken to be part of a
+ * paste, whatever else is available is then sent along in the same packet */
+static ssize_t CLIENT_PASTE_MIN = 64;
+/* milliseconds to wait for a session server to respond when probing whether it
+ * is alive, servers which take longer are listed as unresponsive */
+static int PROBE_TIMEOUT = 1000;
+/* milliseconds between the echo of a latency probe (-L) and the next keystroke */
+static int LATENCY_INTERVAL = 10;
+/* host all sessions of a socket directory in a single daemon process instead of
+ * one server process per session, can be enabled at run time using -D */
+static bool SESSION_DAEMON = false;
+/* number of warm sessions per command which are kept ready to be claimed by
+ * the next session created with -W, 0 disables the pool, can be overridden at
+ * run time using $ABDUCO_POOL */
+static unsigned int POOL_SIZE = 0;
+/* drain the pty from a dedicated thread into a ring of PTY_RING_SIZE bytes,
+ * such that the application is not held up while the clients are served */
+static bool PTY_THREAD = false;
+static size_t PTY_RING_SIZE = 1024 * 1024;
+/* Recordings (-R) are written by a separate thread for which the main loop
+ * queues at most RECORD_QUEUE_SIZE bytes, output which does not fit is left
+ * out and marked as such. Every RECORD_KEYFRAME_INTERVAL seconds the whole
+ * screen is recorded, replays can start there. */
+static size_t RECORD_QUEUE_SIZE = 4 * 1024 * 1024;
+static int RECORD_KEYFRAME_INTERVAL = 60;
+/* client input queued for the pty while the application does not read it,
+ * the sending clients are not read from until half of it was consumed */
+static size_t PTY_INPUT_MAX = 1024 * 1024;
+/* most recent output kept per session for tail queries (-t), 0 disables it */
+static size_t HISTORY_SIZE = 64 * 1024;
+/* milliseconds after which -w rescans the socket directory even if it was not
+ * notified of a change, e.g. to notice servers which were killed */
+static int WATCH_INTERVAL = 1000;
@@ -0,0 +1,16 @@
+# This version of config.mk was generated by:
+# ./configure
+# Any changes made here will be lost if configure is re-run
+SRCDIR = .
+PREFIX = /usr/local
+EXEC_PREFIX = $(PREFIX)
+BINDIR = $(EXEC_PREFIX)/bin
+MANPREFIX = $(PREFIX)/share/man
+CC = cc
+CFLAGS = -pipe -Os -ffunction-sections -fdata-sections -fPIE
+LDFLAGS = -Wl,-z,now -Wl,-z,relro
+CFLAGS_STD = -std=c99 -D_POSIX_C_SOURCE=200809L -D_XOPEN_SOURCE=700 -DNDEBUG -D_FORTIFY_SOURCE=2
+LDFLAGS_STD = -lc -lutil -lpthread
+CFLAGS_AUTO = -fstack-protector-all
+LDFLAGS_AUTO = -Wl,--gc-sections -pie
+CFLAGS_DEBUG = -U_FORTIFY_SOURCE -UNDEBUG -O0 -g -ggdb -Wall -Wextra -pedantic -Wno-unused-parameter -Wno-sign-compare
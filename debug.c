@@ -18,6 +18,12 @@ static void print_packet(const char *prefix, Packet *pkt) {
 		[MSG_RESIZE]  = "RESIZE",
 		[MSG_EXIT]    = "EXIT",
 		[MSG_PID]     = "PID",
+		[MSG_HELLO]   = "HELLO",
+		[MSG_STATS]   = "STATS",
+		[MSG_TIMING]  = "TIMING",
+		[MSG_CREATE]  = "CREATE",
+		[MSG_CLAIM]   = "CLAIM",
+		[MSG_TAIL]    = "TAIL",
 	};
 	const char *type = "UNKNOWN";
 	if (pkt->type < countof(msgtype) && msgtype[pkt->type])
@@ -26,15 +32,19 @@ static void print_packet(const char *prefix, Packet *pkt) {
 	fprintf(stderr, "%s: %s ", prefix, type);
 	switch (pkt->type) {
 	case MSG_CONTENT:
-		fwrite(pkt->u.msg, pkt->len, 1, stderr);
+		if (pkt->len <= sizeof(pkt->u.msg))
+			fwrite(pkt->u.msg, pkt->len, 1, stderr);
+		else
+			fprintf(stderr, "len: %"PRIu32, pkt->len);
 		break;
 	case MSG_RESIZE:
 		fprintf(stderr, "%"PRIu16"x%"PRIu16, pkt->u.ws.cols, pkt->u.ws.rows);
 		break;
 	case MSG_ATTACH:
-		fprintf(stderr, "readonly: %d low-priority: %d",
-			pkt->u.i & CLIENT_READONLY,
-			pkt->u.i & CLIENT_LOWPRIORITY);
+		fprintf(stderr, "readonly: %d low-priority: %d refresh: %"PRIu32,
+			pkt->u.attach.flags & CLIENT_READONLY,
+			pkt->u.attach.flags & CLIENT_LOWPRIORITY,
+			pkt->len >= sizeof(pkt->u.attach) ? pkt->u.attach.refresh : 0);
 		break;
 	case MSG_EXIT:
 		fprintf(stderr, "status: %"PRIu32, pkt->u.i);
@@ -42,6 +52,17 @@ static void print_packet(const char *prefix, Packet *pkt) {
 	case MSG_PID:
 		fprintf(stderr, "pid: %"PRIu32, pkt->u.i);
 		break;
+	case MSG_HELLO:
+		fprintf(stderr, "version: %"PRIu32" max: %"PRIu32" caps: %"PRIu32,
+			pkt->u.hello.version, pkt->u.hello.max, pkt->u.hello.caps);
+		break;
+	case MSG_TAIL:
+		fprintf(stderr, "len: %"PRIu64, pkt->u.l);
+		break;
+	case MSG_TIMING:
+		fprintf(stderr, "received: %"PRIu64" written: %"PRIu64" read: %"PRIu64" sent: %"PRIu64,
+			pkt->u.timing.received, pkt->u.timing.written, pkt->u.timing.read, pkt->u.timing.sent);
+		break;
 	default:
 		fprintf(stderr, "len: %"PRIu32, pkt->len);
 		break;
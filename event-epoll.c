@@ -0,0 +1,45 @@
+#include <sys/epoll.h>
+
+static int event_fd = -1;
+
+static int event_init(void) {
+	if (event_fd == -1)
+		event_fd = epoll_create1(EPOLL_CLOEXEC);
+	return event_fd == -1 ? -1 : 0;
+}
+
+static int event_ctl(int op, int fd, int events, void *data) {
+	struct epoll_event ev = { .data.ptr = data };
+	if (events & EVENT_READ)
+		ev.events |= EPOLLIN;
+	if (events & EVENT_WRITE)
+		ev.events |= EPOLLOUT;
+	return epoll_ctl(event_fd, op, fd, &ev);
+}
+
+static int event_add(int fd, int events, void *data) {
+	return event_ctl(EPOLL_CTL_ADD, fd, events, data);
+}
+
+static int event_mod(int fd, int events, void *data) {
+	return event_ctl(EPOLL_CTL_MOD, fd, events, data);
+}
+
+static int event_del(int fd) {
+	return epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int event_wait(Event *events, int max, int timeout) {
+	struct epoll_event evs[max];
+	int n = epoll_wait(event_fd, evs, max, timeout);
+	for (int i = 0; i < n; i++) {
+		events[i].data = evs[i].data.ptr;
+		events[i].events = 0;
+		/* errors and hangups are reported by the subsequent read(2) */
+		if (evs[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+			events[i].events |= EVENT_READ;
+		if (evs[i].events & EPOLLOUT)
+			events[i].events |= EVENT_WRITE;
+	}
+	return n;
+}
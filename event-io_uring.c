@@ -0,0 +1,133 @@
+/* io_uring(7) based submission of the writes to all clients of a session,
+ * readiness is still reported by epoll(7). The writes are issued as one
+ * batch with a single io_uring_enter(2) instead of a writev(2) per client.
+ * If the kernel refuses to set up a ring, they are issued one by one. */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define EVENT_RING_ENTRIES 64
+
+static struct {
+	int fd;               /* -1 before the setup, -2 if io_uring is unavailable */
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned entries;
+} event_ring = { .fd = -1 };
+
+static int event_ring_enter(unsigned submit, unsigned complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, event_ring.fd, submit, complete, flags, NULL, 0);
+}
+
+static bool event_ring_setup(void) {
+	if (event_ring.fd != -1)
+		return event_ring.fd >= 0;
+	event_ring.fd = -2;
+	struct io_uring_params p = { 0 };
+	int fd = syscall(__NR_io_uring_setup, EVENT_RING_ENTRIES, &p);
+	if (fd == -1)
+		return false;
+	/* the submission and completion rings share one mapping since Linux 5.4 */
+	size_t size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+	                  p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	char *rings = MAP_FAILED;
+	void *sqes = MAP_FAILED;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		rings = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+	if (rings != MAP_FAILED)
+		sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+		            MAP_SHARED, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (rings != MAP_FAILED)
+			munmap(rings, size);
+		close(fd);
+		return false;
+	}
+	event_ring.sq_tail = (unsigned*)(rings + p.sq_off.tail);
+	event_ring.sq_mask = (unsigned*)(rings + p.sq_off.ring_mask);
+	event_ring.sq_array = (unsigned*)(rings + p.sq_off.array);
+	event_ring.cq_head = (unsigned*)(rings + p.cq_off.head);
+	event_ring.cq_tail = (unsigned*)(rings + p.cq_off.tail);
+	event_ring.cq_mask = (unsigned*)(rings + p.cq_off.ring_mask);
+	event_ring.cqes = (struct io_uring_cqe*)(rings + p.cq_off.cqes);
+	event_ring.sqes = sqes;
+	event_ring.entries = p.sq_entries;
+	event_ring.fd = fd;
+	return true;
+}
+
+/* reap the completions of the batch, returns how many there were */
+static int event_ring_reap(EventWrite *w) {
+	unsigned head = *event_ring.cq_head;
+	int count = 0;
+	unsigned tail = __atomic_load_n(event_ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, count++) {
+		struct io_uring_cqe *cqe = &event_ring.cqes[head & *event_ring.cq_mask];
+		EventWrite *r = &w[cqe->user_data];
+		r->result = cqe->res < 0 ? -1 : cqe->res;
+		r->error = cqe->res < 0 ? -cqe->res : 0;
+	}
+	__atomic_store_n(event_ring.cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+/* submit up to a ring full of writes, returns how many were performed */
+static int event_ring_writev(EventWrite *w, int count) {
+	struct msghdr msg[count];
+	unsigned tail = *event_ring.sq_tail, mask = *event_ring.sq_mask;
+	for (int i = 0; i < count; i++) {
+		msg[i] = (struct msghdr){ .msg_iov = w[i].iov, .msg_iovlen = w[i].count };
+		unsigned index = (tail + i) & mask;
+		struct io_uring_sqe *sqe = &event_ring.sqes[index];
+		memset(sqe, 0, sizeof *sqe);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = w[i].fd;
+		sqe->addr = (uintptr_t)&msg[i];
+		sqe->len = 1;
+		/* fail with EAGAIN instead of waiting for the socket */
+		sqe->msg_flags = MSG_DONTWAIT|MSG_NOSIGNAL;
+		sqe->user_data = i;
+		event_ring.sq_array[index] = index;
+		w[i].result = -1;
+		w[i].error = EIO;
+	}
+	__atomic_store_n(event_ring.sq_tail, tail + count, __ATOMIC_RELEASE);
+
+	int submitted = 0;
+	while (submitted < count) {
+		int n = event_ring_enter(count - submitted, 0, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		submitted += n;
+	}
+	/* take back the entries the kernel did not consume */
+	__atomic_store_n(event_ring.sq_tail, tail + submitted, __ATOMIC_RELEASE);
+	/* the non-blocking sends usually completed during the submission */
+	for (int done = event_ring_reap(w); done < submitted; done += event_ring_reap(w)) {
+		if (event_ring_enter(0, submitted - done, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+			/* late completions would be mistaken for those of another batch */
+			close(event_ring.fd);
+			event_ring.fd = -2;
+			break;
+		}
+	}
+	return submitted;
+}
+
+static void event_writev(EventWrite *w, int count) {
+	if (count > 1 && event_ring_setup()) {
+		while (count > 0) {
+			int n = event_ring_writev(w, MIN(count, (int)event_ring.entries));
+			if (n == 0)
+				break;
+			w += n;
+			count -= n;
+		}
+	}
+	event_writev_each(w, count);
+}
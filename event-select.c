@@ -0,0 +1,76 @@
+/* portable select(2) based fallback, limited to FD_SETSIZE descriptors */
+
+static struct {
+	fd_set readfds, writefds;
+	int fdmax;
+	void *data[FD_SETSIZE];
+} event_state = { .fdmax = -1 };
+
+static int event_init(void) {
+	FD_ZERO(&event_state.readfds);
+	FD_ZERO(&event_state.writefds);
+	event_state.fdmax = -1;
+	return 0;
+}
+
+static int event_mod(int fd, int events, void *data) {
+	if (fd < 0 || fd >= FD_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	FD_CLR(fd, &event_state.readfds);
+	FD_CLR(fd, &event_state.writefds);
+	if (events & EVENT_READ)
+		FD_SET(fd, &event_state.readfds);
+	if (events & EVENT_WRITE)
+		FD_SET(fd, &event_state.writefds);
+	event_state.data[fd] = data;
+	if (fd > event_state.fdmax)
+		event_state.fdmax = fd;
+	return 0;
+}
+
+static int event_add(int fd, int events, void *data) {
+	return event_mod(fd, events, data);
+}
+
+static int event_del(int fd) {
+	if (fd < 0 || fd >= FD_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	FD_CLR(fd, &event_state.readfds);
+	FD_CLR(fd, &event_state.writefds);
+	event_state.data[fd] = NULL;
+	while (event_state.fdmax >= 0 &&
+	       !FD_ISSET(event_state.fdmax, &event_state.readfds) &&
+	       !FD_ISSET(event_state.fdmax, &event_state.writefds))
+		event_state.fdmax--;
+	return 0;
+}
+
+static int event_wait(Event *events, int max, int timeout) {
+	fd_set readfds = event_state.readfds;
+	fd_set writefds = event_state.writefds;
+	struct timeval tv = {
+		.tv_sec = timeout / 1000,
+		.tv_usec = (timeout % 1000) * 1000,
+	};
+	int n = select(event_state.fdmax+1, &readfds, &writefds, NULL, timeout < 0 ? NULL : &tv);
+	if (n <= 0)
+		return n;
+	n = 0;
+	for (int fd = 0; fd <= event_state.fdmax && n < max; fd++) {
+		int ev = 0;
+		if (FD_ISSET(fd, &readfds))
+			ev |= EVENT_READ;
+		if (FD_ISSET(fd, &writefds))
+			ev |= EVENT_WRITE;
+		if (!ev)
+			continue;
+		events[n].data = event_state.data[fd];
+		events[n].events = ev;
+		n++;
+	}
+	return n;
+}
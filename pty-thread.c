@@ -0,0 +1,159 @@
+/* Optional reader thread per session (see PTY_THREAD in config.h) which drains
+ * the pty into a ring, the main loop then takes its batches from there. The
+ * application can thus keep writing while the clients are being served. The
+ * ring has a single producer and a single consumer and needs no locks: only
+ * the reader advances the tail and only the main loop advances the head. */
+
+#include <pthread.h>
+
+struct PtyRing {
+	char *data;
+	size_t size;
+	size_t head, tail;   /* bytes consumed and produced so far */
+	int notify[2];       /* readable once data arrived, watched by the main loop */
+	int wake[2];         /* readable once space was freed or the reader should stop */
+	bool notified;       /* the consumer was notified and will look at the tail */
+	bool waiting;        /* the reader waits for space */
+	bool stop;
+	bool eof;            /* the pty was closed, no more data will follow */
+	uint64_t read_at;    /* clock_us() of the latest read */
+	pthread_t thread;
+	bool started;
+};
+
+static void pty_ring_signal(int fd) {
+	while (write(fd, "", 1) == -1 && errno == EINTR);
+}
+
+static void pty_ring_drain(int fd) {
+	char buf[64];
+	while (read(fd, buf, sizeof buf) > 0);
+}
+
+static int pty_ring_pipe(int fd[2]) {
+	if (pipe(fd) == -1)
+		return -1;
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(fd[i], F_GETFL);
+		if (flags == -1 || fcntl(fd[i], F_SETFL, flags | O_NONBLOCK) == -1 ||
+		    fcntl(fd[i], F_SETFD, FD_CLOEXEC) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static void *pty_ring_reader(void *arg) {
+	Server *s = arg;
+	PtyRing *r = s->ring;
+	while (!__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST)) {
+		size_t tail = r->tail;
+		size_t space = r->size - (tail - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST));
+		if (!space) {
+			/* recheck after announcing it, the consumer might just have made room */
+			__atomic_store_n(&r->waiting, true, __ATOMIC_SEQ_CST);
+			space = r->size - (tail - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST));
+		}
+		struct pollfd pfd[2] = {
+			{ .fd = r->wake[0], .events = POLLIN },
+			{ .fd = space ? s->pty : -1, .events = POLLIN },
+		};
+		if (poll(pfd, countof(pfd), -1) == -1)
+			continue;
+		if (pfd[0].revents)
+			pty_ring_drain(r->wake[0]);
+		if (!space || !pfd[1].revents)
+			continue;
+		size_t offset = tail % r->size;
+		ssize_t len = read(s->pty, r->data + offset, MIN(space, r->size - offset));
+		if (len == -1 && (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK))
+			continue;
+		__atomic_fetch_add(&s->status->pty_reads, 1, __ATOMIC_RELAXED);
+		if (len <= 0) {
+			__atomic_store_n(&r->eof, true, __ATOMIC_SEQ_CST);
+			pty_ring_signal(r->notify[1]);
+			break;
+		}
+		__atomic_store_n(&r->read_at, clock_us(), __ATOMIC_RELAXED);
+		__atomic_store_n(&r->tail, tail + len, __ATOMIC_SEQ_CST);
+		if (!__atomic_exchange_n(&r->notified, true, __ATOMIC_SEQ_CST))
+			pty_ring_signal(r->notify[1]);
+	}
+	return NULL;
+}
+
+static void pty_ring_free(Server *s) {
+	PtyRing *r = s->ring;
+	if (!r)
+		return;
+	if (r->started) {
+		__atomic_store_n(&r->stop, true, __ATOMIC_SEQ_CST);
+		pty_ring_signal(r->wake[1]);
+		pthread_join(r->thread, NULL);
+	}
+	for (int i = 0; i < 2; i++) {
+		if (r->notify[i] != -1)
+			close(r->notify[i]);
+		if (r->wake[i] != -1)
+			close(r->wake[i]);
+	}
+	free(r->data);
+	free(r);
+	s->ring = NULL;
+}
+
+/* start the reader, on failure the main loop keeps reading the pty itself */
+static bool pty_ring_start(Server *s) {
+	PtyRing *r = calloc(1, sizeof *r);
+	if (!r)
+		return false;
+	s->ring = r;
+	r->notify[0] = r->notify[1] = r->wake[0] = r->wake[1] = -1;
+	r->size = MAX(PTY_RING_SIZE, PTY_BATCH_MAX);
+	if (!(r->data = malloc(r->size)) || pty_ring_pipe(r->notify) == -1 || pty_ring_pipe(r->wake) == -1)
+		goto error;
+	/* signals are handled by the main loop */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int err = pthread_create(&r->thread, NULL, pty_ring_reader, s);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err)
+		goto error;
+	r->started = true;
+	return true;
+error:
+	pty_ring_free(s);
+	return false;
+}
+
+/* take a batch of at most limit bytes from the ring */
+static bool pty_ring_read(Server *s, Buffer *batch, size_t limit) {
+	PtyRing *r = s->ring;
+	pty_ring_drain(r->notify[0]);
+	__atomic_store_n(&r->notified, false, __ATOMIC_SEQ_CST);
+	size_t head = r->head;
+	size_t len = MIN(__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) - head, limit);
+	if (!len) {
+		if (__atomic_load_n(&r->eof, __ATOMIC_SEQ_CST) &&
+		    __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head)
+			s->running = false;
+		return false;
+	}
+	if (!buffer_reserve(batch, len))
+		return false;
+	size_t offset = head % r->size, first = MIN(len, r->size - offset);
+	memcpy(batch->data + batch->end, r->data + offset, first);
+	memcpy(batch->data + batch->end + first, r->data, len - first);
+	batch->end += len;
+	s->pty_read_at = __atomic_load_n(&r->read_at, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&r->waiting, false, __ATOMIC_SEQ_CST))
+		pty_ring_signal(r->wake[1]);
+	return true;
+}
+
+/* whether data is left over which did not fit into the previous batch */
+static bool pty_ring_pending(PtyRing *r) {
+	return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head ||
+	       __atomic_load_n(&r->eof, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,468 @@
+/* Recording of the output of a session (-R) and its replay (-P). The main loop
+ * appends timestamped records to a bounded queue from which a writer thread
+ * appends them to the file, a slow disk thus never holds up the pty. Output
+ * which does not fit into the queue is replaced by a gap record. Recordings
+ * whose name ends in .gz are compressed if zlib support was enabled.
+ *
+ * A recording starts with a RecordHeader, followed by records consisting of
+ * a Record header and its payload, all in host byte order. Every so often a
+ * keyframe holding a repaint of the whole screen is recorded, a replay can
+ * start at any of them. A complete recording ends with an index of these
+ * keyframes, whose trailer is found at the very end of the file. */
+
+#if defined(HAVE_ZLIB)
+# include <zlib.h>
+#endif
+
+#define RECORD_MAGIC "abdurec1"
+#define RECORD_INDEX_MAGIC "abduidx1"
+/* largest payload a replay accepts, anything beyond is taken as corruption */
+#define RECORD_PAYLOAD_MAX (64 * 1024 * 1024)
+
+typedef struct {
+	char magic[8];      /* RECORD_MAGIC */
+	uint64_t started;   /* wall clock time in microseconds since the epoch */
+	uint16_t rows, cols;
+	uint32_t pad;
+} RecordHeader;
+
+typedef struct {
+	uint32_t type;
+	uint32_t len;       /* of the payload following the header */
+	uint64_t time;      /* microseconds since the recording started */
+} Record;
+
+enum {
+	RECORD_OUTPUT   = 0, /* output of the command */
+	RECORD_RESIZE   = 1, /* rows and columns as two uint16_t */
+	RECORD_KEYFRAME = 2, /* repaint of the whole screen */
+	RECORD_GAP      = 3, /* uint64_t number of output bytes left out */
+	RECORD_INDEX    = 4, /* RecordIndex per keyframe followed by a RecordTrailer */
+};
+
+typedef struct {
+	uint64_t time;      /* of the keyframe */
+	uint64_t offset;    /* of its record from the start of the recording */
+	uint16_t rows, cols; /* of the screen at that point */
+	uint32_t pad;
+} RecordIndex;
+
+typedef struct {
+	uint64_t offset;    /* of the index record */
+	char magic[8];      /* RECORD_INDEX_MAGIC */
+} RecordTrailer;
+
+/* flags of a recording passed along with its descriptor */
+enum {
+	RECORD_COMPRESS = 1 << 0,
+};
+
+struct Recorder {
+	int fd;
+#if defined(HAVE_ZLIB)
+	gzFile gz;           /* if compressing */
+#endif
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	Buffer queue;        /* records not yet taken by the writer, guarded by lock */
+	Buffer writing;      /* records being written, owned by the writer */
+	bool flush;          /* a keyframe was queued, guarded by lock */
+	bool stop;           /* guarded by lock */
+	bool failed;         /* a write failed, everything after it is discarded */
+	uint64_t lost;       /* output bytes left out since the last gap record */
+	uint64_t started;    /* clock_us() when the recording started */
+	uint64_t keyframe_at;
+	uint64_t offset;     /* of the next record, i.e. bytes queued so far */
+	uint16_t rows, cols; /* current size of the screen */
+	Buffer index;        /* RecordIndex of the keyframes, owned by the main loop */
+};
+
+/* recordings still being written out, the server waits for them before exiting */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int writers;
+} recorders = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
+static void record_free(Recorder *r) {
+#if defined(HAVE_ZLIB)
+	if (r->gz)
+		gzclose(r->gz);
+	else
+#endif
+	close(r->fd);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	buffer_free(&r->queue);
+	buffer_free(&r->writing);
+	free(r);
+}
+
+static bool record_write(Recorder *r, const char *data, size_t len) {
+#if defined(HAVE_ZLIB)
+	if (r->gz)
+		return gzwrite(r->gz, data, len) == (int)len;
+#endif
+	return write_all(r->fd, data, len) == (ssize_t)len;
+}
+
+static void *record_writer(void *arg) {
+	Recorder *r = arg;
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (!buffer_len(&r->queue) && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (!buffer_len(&r->queue))
+			break;
+		/* swap the buffers such that the main loop can keep appending */
+		Buffer batch = r->queue;
+		r->queue = r->writing;
+		r->writing = batch;
+		bool flush = r->flush;
+		r->flush = false;
+		pthread_mutex_unlock(&r->lock);
+		if (!r->failed && !record_write(r, batch.data + batch.start, buffer_len(&batch)))
+			r->failed = true;
+	#if defined(HAVE_ZLIB)
+		/* keep the recording readable up to the latest keyframe */
+		if (!r->failed && r->gz && flush && gzflush(r->gz, Z_SYNC_FLUSH) != Z_OK)
+			r->failed = true;
+	#else
+		(void)flush;
+	#endif
+		debug("record-write: %zu bytes%s\n", buffer_len(&batch), r->failed ? " FAILED" : "");
+		r->writing.start = r->writing.end = 0;
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	record_free(r);
+	pthread_mutex_lock(&recorders.lock);
+	recorders.writers--;
+	pthread_cond_broadcast(&recorders.done);
+	pthread_mutex_unlock(&recorders.lock);
+	return NULL;
+}
+
+/* append a record to the queue, returns false if it does not fit */
+static bool record_queue(Recorder *r, uint32_t type, const char *data, size_t len) {
+	Record rec = { .type = type, .len = len, .time = clock_us() - r->started };
+	pthread_mutex_lock(&r->lock);
+	bool empty = !buffer_len(&r->queue);
+	bool queued = buffer_len(&r->queue) + sizeof rec + len <= RECORD_QUEUE_SIZE &&
+	              buffer_append(&r->queue, (char*)&rec, sizeof rec) &&
+	              buffer_append(&r->queue, data, len);
+	if (queued)
+		r->offset += sizeof rec + len;
+	if (queued && type == RECORD_KEYFRAME)
+		r->flush = true;
+	/* the writer only waits while there is nothing to write */
+	if (queued && empty)
+		pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	return queued;
+}
+
+static void record_output(Recorder *r, const char *data, size_t len) {
+	if (r->lost && record_queue(r, RECORD_GAP, (char*)&r->lost, sizeof r->lost))
+		r->lost = 0;
+	if (r->lost || !record_queue(r, RECORD_OUTPUT, data, len))
+		r->lost += len;
+}
+
+static void record_resize(Recorder *r, struct winsize *ws) {
+	uint16_t size[2] = { ws->ws_row, ws->ws_col };
+	record_queue(r, RECORD_RESIZE, (char*)size, sizeof size);
+	r->rows = ws->ws_row;
+	r->cols = ws->ws_col;
+}
+
+/* whether the next keyframe is due */
+static bool record_keyframe_due(Recorder *r) {
+	return RECORD_KEYFRAME_INTERVAL > 0 &&
+	       clock_us() - r->keyframe_at >= RECORD_KEYFRAME_INTERVAL * 1000000ULL;
+}
+
+static void record_keyframe(Recorder *r, const char *data, size_t len) {
+	RecordIndex entry = { .offset = r->offset, .rows = r->rows, .cols = r->cols };
+	r->keyframe_at = clock_us();
+	entry.time = r->keyframe_at - r->started;
+	if (record_queue(r, RECORD_KEYFRAME, data, len))
+		buffer_append(&r->index, (char*)&entry, sizeof entry);
+}
+
+/* have the writer close the recording once it wrote out what is queued */
+static void record_stop(Recorder *r) {
+	if (!r)
+		return;
+	RecordTrailer trailer = { .offset = r->offset, .magic = RECORD_INDEX_MAGIC };
+	if (buffer_append(&r->index, (char*)&trailer, sizeof trailer))
+		record_queue(r, RECORD_INDEX, r->index.data, buffer_len(&r->index));
+	buffer_free(&r->index);
+	pthread_mutex_lock(&r->lock);
+	r->stop = true;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* wait until all stopped recordings are complete */
+static void record_wait(void) {
+	pthread_mutex_lock(&recorders.lock);
+	while (recorders.writers > 0)
+		pthread_cond_wait(&recorders.done, &recorders.lock);
+	pthread_mutex_unlock(&recorders.lock);
+}
+
+/* start recording into fd, which is closed once the recording stops */
+static Recorder *record_start(int fd, uint32_t flags, struct winsize *ws) {
+	struct timespec now;
+	Recorder *r = calloc(1, sizeof *r);
+	if (!r) {
+		close(fd);
+		return NULL;
+	}
+	r->fd = fd;
+	r->started = r->keyframe_at = clock_us();
+	r->offset = sizeof(RecordHeader);
+	r->rows = ws->ws_row;
+	r->cols = ws->ws_col;
+#if defined(HAVE_ZLIB)
+	if ((flags & RECORD_COMPRESS) && !(r->gz = gzdopen(fd, "wb"))) {
+		close(fd);
+		free(r);
+		return NULL;
+	}
+#endif
+	clock_gettime(CLOCK_REALTIME, &now);
+	RecordHeader header = {
+		.magic = RECORD_MAGIC,
+		.started = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000,
+		.rows = ws->ws_row,
+		.cols = ws->ws_col,
+	};
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if (!buffer_append(&r->queue, (char*)&header, sizeof header))
+		goto error;
+	/* signals are handled by the main loop */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t thread;
+	pthread_mutex_lock(&recorders.lock);
+	int err = pthread_create(&thread, NULL, record_writer, r);
+	if (!err) {
+		pthread_detach(thread);
+		recorders.writers++;
+	}
+	pthread_mutex_unlock(&recorders.lock);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err)
+		goto error;
+	return r;
+error:
+	record_free(r);
+	return NULL;
+}
+
+/* open a recording for the session about to be created */
+static int record_open(const char *path, uint32_t *flags) {
+	size_t len = strlen(path);
+	*flags = len > 3 && !strcmp(path + len - 3, ".gz") ? RECORD_COMPRESS : 0;
+#if !defined(HAVE_ZLIB)
+	if (*flags & RECORD_COMPRESS) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+	return open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+}
+
+typedef struct {
+#if defined(HAVE_ZLIB)
+	gzFile gz;           /* reads compressed and uncompressed recordings */
+#else
+	int fd;
+#endif
+	Buffer payload;
+} Replay;
+
+static bool replay_read(Replay *p, void *buf, size_t len) {
+#if defined(HAVE_ZLIB)
+	return gzread(p->gz, buf, len) == (int)len;
+#else
+	return read_all(p->fd, buf, len) == (ssize_t)len;
+#endif
+}
+
+static off_t replay_seek(Replay *p, off_t offset, int whence) {
+#if defined(HAVE_ZLIB)
+	return gzseek(p->gz, offset, whence);
+#else
+	return lseek(p->fd, offset, whence);
+#endif
+}
+
+/* read the next record along with its payload */
+static bool replay_next(Replay *p, Record *rec) {
+	if (!replay_read(p, rec, sizeof *rec) || rec->len > RECORD_PAYLOAD_MAX)
+		return false;
+	p->payload.start = p->payload.end = 0;
+	if (!buffer_reserve(&p->payload, rec->len) || !replay_read(p, p->payload.data, rec->len))
+		return false;
+	p->payload.end = rec->len;
+	return true;
+}
+
+/* Offset of the last keyframe at or before start according to the index of
+ * a complete, uncompressed recording, along with the size of the screen at
+ * that point. Returns 0 if there is no index or no such keyframe. */
+static off_t replay_index(const char *path, uint64_t start, uint16_t *rows, uint16_t *cols) {
+	RecordTrailer trailer;
+	RecordIndex entry;
+	Record rec;
+	struct stat st;
+	off_t found = 0;
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)(sizeof(RecordHeader) + sizeof rec + sizeof trailer) &&
+	    pread(fd, &trailer, sizeof trailer, st.st_size - sizeof trailer) == sizeof trailer &&
+	    !memcmp(trailer.magic, RECORD_INDEX_MAGIC, sizeof trailer.magic) &&
+	    trailer.offset <= (uint64_t)st.st_size - sizeof rec - sizeof trailer &&
+	    pread(fd, &rec, sizeof rec, trailer.offset) == sizeof rec && rec.type == RECORD_INDEX &&
+	    trailer.offset + sizeof rec + rec.len == (uint64_t)st.st_size) {
+		off_t pos = trailer.offset + sizeof rec;
+		for (size_t n = (rec.len - sizeof trailer) / sizeof entry; n > 0; n--, pos += sizeof entry) {
+			if (pread(fd, &entry, sizeof entry, pos) != sizeof entry || entry.time > start ||
+			    entry.offset >= trailer.offset)
+				break;
+			found = entry.offset;
+			*rows = entry.rows;
+			*cols = entry.cols;
+		}
+	}
+	close(fd);
+	return found;
+}
+
+/* ask the terminal to take the size of the recorded screen, where supported */
+static void replay_resize(uint16_t rows, uint16_t cols) {
+	char seq[32];
+	if (!has_term || !rows || !cols || (rows == server.winsize.ws_row && cols == server.winsize.ws_col))
+		return;
+	int len = snprintf(seq, sizeof seq, "\033[8;%u;%ut", (unsigned)rows, (unsigned)cols);
+	write_all(STDOUT_FILENO, seq, len);
+	server.winsize.ws_row = rows;
+	server.winsize.ws_col = cols;
+}
+
+/* wait for the given number of microseconds, returns false if the user quit */
+static bool replay_wait(uint64_t us) {
+	uint64_t until = clock_us() + us;
+	for (uint64_t now = clock_us(); now < until; now = clock_us()) {
+		struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+		int timeout = MIN((until - now + 999) / 1000, (uint64_t)INT_MAX);
+		if (poll(&pfd, has_term ? 1 : 0, timeout) <= 0)
+			continue;
+		char key;
+		if (read(STDIN_FILENO, &key, 1) == 1 && key == KEY_DETACH)
+			return false;
+	}
+	return true;
+}
+
+/* Play a recording at the given speed, as fast as possible if it is zero,
+ * starting start seconds into it. The screen at that point is reproduced
+ * from the closest keyframe before it, found through the index, and the
+ * output since then. Returns the exit status of the program. */
+static int replay_session(const char *path, double speed, double start) {
+	Replay p = { 0 };
+	RecordHeader header;
+	Record rec;
+	Vt *vt = NULL;
+#if defined(HAVE_ZLIB)
+	if (!(p.gz = gzopen(path, "rb")))
+		die("replay-open");
+#else
+	if ((p.fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		die("replay-open");
+#endif
+	if (!replay_read(&p, &header, sizeof header) || memcmp(header.magic, RECORD_MAGIC, sizeof header.magic)) {
+		fprintf(stderr, "%s: %s: not a recording\n", server.name, path);
+		return EXIT_FAILURE;
+	}
+	uint16_t rows = header.rows, cols = header.cols;
+	struct winsize ws = server.winsize;
+	uint64_t skip = start > 0 ? start * 1000000 : 0;
+	bool pending = false; /* the first record beyond skip was already read */
+	if (skip) {
+		off_t offset = replay_index(path, skip, &rows, &cols);
+		if (offset && replay_seek(&p, offset, SEEK_SET) == -1)
+			die("replay-seek");
+		if (!(vt = vt_create(rows, cols)))
+			die("replay-screen");
+		while ((pending = replay_next(&p, &rec)) && rec.time <= skip) {
+			switch (rec.type) {
+			case RECORD_RESIZE:
+				if (rec.len >= 2 * sizeof(uint16_t)) {
+					memcpy(&rows, p.payload.data, sizeof rows);
+					memcpy(&cols, p.payload.data + sizeof rows, sizeof cols);
+					vt_resize(vt, rows, cols);
+				}
+				break;
+			case RECORD_KEYFRAME:
+			case RECORD_OUTPUT:
+				vt_process(vt, p.payload.data, buffer_len(&p.payload));
+				break;
+			}
+		}
+	}
+
+	client_setup_terminal();
+	replay_resize(rows, cols);
+	if (vt) {
+		Buffer screen = { 0 };
+		if (vt_repaint(vt, &screen))
+			write_all(STDOUT_FILENO, screen.data + screen.start, buffer_len(&screen));
+		buffer_free(&screen);
+		vt_free(vt);
+	}
+	uint64_t played = skip; /* recording time reached so far */
+	bool quit = false, gap = false;
+	while (!quit && (pending || replay_next(&p, &rec))) {
+		pending = false;
+		if (rec.time > played && speed > 0)
+			quit = !replay_wait((rec.time - played) / speed);
+		played = MAX(played, rec.time);
+		switch (rec.type) {
+		case RECORD_GAP:
+			gap = true;
+			break;
+		case RECORD_RESIZE:
+			if (rec.len >= 2 * sizeof(uint16_t)) {
+				memcpy(&rows, p.payload.data, sizeof rows);
+				memcpy(&cols, p.payload.data + sizeof rows, sizeof cols);
+				replay_resize(rows, cols);
+			}
+			break;
+		case RECORD_KEYFRAME:
+			/* only needed to recover after a gap */
+			if (!gap)
+				break;
+			gap = false;
+			/* fall through */
+		case RECORD_OUTPUT:
+			write_all(STDOUT_FILENO, p.payload.data, buffer_len(&p.payload));
+			break;
+		}
+	}
+	replay_resize(ws.ws_row, ws.ws_col);
+	client_restore_terminal();
+#if defined(HAVE_ZLIB)
+	gzclose(p.gz);
+#else
+	close(p.fd);
+#endif
+	buffer_free(&p.payload);
+	return EXIT_SUCCESS;
+}
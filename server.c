@@ -1,38 +1,176 @@
-#define FD_SET_MAX(fd, set, maxfd) do { \
-		FD_SET(fd, set);        \
-		if (fd > maxfd)         \
-			maxfd = fd;     \
-	} while (0)
+static Server *servers;        /* sessions hosted by this process */
+static Server *servers_active; /* sessions to process in the current iteration */
+static Source daemon_source = { .type = SOURCE_DAEMON };
+static Request *requests;      /* pending connections to the control socket of the daemon */
 
-static Client *client_malloc(int socket) {
+/* data sent to several clients, copied into a chunk once the first of them
+ * has to queue it, all others then reference the same chunk */
+typedef struct {
+	const char *data;
+	size_t len;
+	Chunk *chunk;
+} Shared;
+
+static Chunk *chunk_new(const char *data, size_t len, size_t size) {
+	Chunk *chunk = malloc(sizeof *chunk + size);
+	if (!chunk)
+		return NULL;
+	chunk->refs = 1;
+	chunk->len = len;
+	chunk->size = size;
+	memcpy(chunk->data, data, len);
+	return chunk;
+}
+
+static void chunk_unref(Chunk *chunk) {
+	if (chunk && --chunk->refs == 0)
+		free(chunk);
+}
+
+static size_t queue_len(Queue *q) {
+	return q->len;
+}
+
+static Segment *queue_last(Queue *q) {
+	return q->count ? &q->segments[(q->first + q->count - 1) % q->size] : NULL;
+}
+
+/* reference len bytes of the chunk starting at offset */
+static bool queue_append(Queue *q, Chunk *chunk, size_t offset, size_t len) {
+	Segment *last = queue_last(q);
+	if (last && last->chunk == chunk && last->offset + last->len == offset) {
+		last->len += len;
+		q->len += len;
+		return true;
+	}
+	if (q->count == q->size) {
+		size_t size = q->size ? 2 * q->size : 8;
+		Segment *segments = malloc(size * sizeof *segments);
+		if (!segments)
+			return false;
+		for (size_t i = 0; i < q->count; i++)
+			segments[i] = q->segments[(q->first + i) % q->size];
+		free(q->segments);
+		q->segments = segments;
+		q->size = size;
+		q->first = 0;
+	}
+	q->segments[(q->first + q->count++) % q->size] = (Segment){ chunk, offset, len };
+	chunk->refs++;
+	q->len += len;
+	return true;
+}
+
+/* queue a private copy of the data */
+static bool queue_append_copy(Queue *q, const char *data, size_t len) {
+	Segment *last = queue_last(q);
+	Chunk *chunk = last ? last->chunk : NULL;
+	/* packet headers and the like accumulate in a chunk nobody else references */
+	if (chunk && chunk->refs == 1 && last->offset + last->len == chunk->len &&
+	    chunk->size - chunk->len >= len) {
+		memcpy(chunk->data + chunk->len, data, len);
+		chunk->len += len;
+		last->len += len;
+		q->len += len;
+		return true;
+	}
+	if (!(chunk = chunk_new(data, len, MAX(len, 4096))))
+		return false;
+	bool queued = queue_append(q, chunk, 0, len);
+	chunk_unref(chunk);
+	return queued;
+}
+
+/* describe up to max iovecs of the queued data, returns their number */
+static int queue_iovec(Queue *q, struct iovec *iov, int max) {
+	int count = 0;
+	for (size_t i = 0; i < q->count && count < max; i++) {
+		Segment *seg = &q->segments[(q->first + i) % q->size];
+		iov[count++] = (struct iovec){ .iov_base = seg->chunk->data + seg->offset, .iov_len = seg->len };
+	}
+	return count;
+}
+
+static void queue_consume(Queue *q, size_t len) {
+	q->len -= MIN(len, q->len);
+	while (q->count && len > 0) {
+		Segment *seg = &q->segments[q->first];
+		size_t skip = MIN(len, seg->len);
+		seg->offset += skip;
+		seg->len -= skip;
+		len -= skip;
+		if (seg->len > 0)
+			break;
+		chunk_unref(seg->chunk);
+		q->first = (q->first + 1) % q->size;
+		q->count--;
+	}
+}
+
+static void queue_free(Queue *q) {
+	queue_consume(q, q->len);
+	free(q->segments);
+	memset(q, 0, sizeof *q);
+}
+
+static Client *client_malloc(Server *s, int socket) {
 	Client *c = calloc(1, sizeof(Client));
 	if (!c)
 		return NULL;
+	c->source = (Source){ .type = SOURCE_CLIENT, .server = s };
 	c->socket = socket;
+	c->packet_max = PACKET_LEGACY_MAX;
 	return c;
 }
 
 static void client_free(Client *c) {
-	if (c && c->socket > 0)
+	if (!c)
+		return;
+	if (c->socket > 0)
 		close(c->socket);
+	if (c->stalled)
+		c->source.server->stalled--;
+	buffer_free(&c->input);
+	queue_free(&c->output);
 	free(c);
 }
 
-static void server_sink_client() {
-	if (!server.clients || !server.clients->next)
+static enum Overflow client_overflow_policy(Client *c) {
+	return c->flags & CLIENT_LOWPRIORITY ? QUEUE_OVERFLOW_LOWPRIORITY : QUEUE_OVERFLOW;
+}
+
+/* bytes queued for the client, including those still in the socket send buffer */
+static size_t client_pending(Client *c) {
+	size_t len = queue_len(&c->output);
+#ifdef SIOCOUTQ
+	int outq;
+	if (ioctl(c->socket, SIOCOUTQ, &outq) == 0 && outq > 0)
+		len += outq;
+#endif
+	return len;
+}
+
+static void server_sink_client(Server *s) {
+	if (!s->clients || !s->clients->next)
 		return;
-	Client *target = server.clients;
-	server.clients = target->next;
-	Client *dst = server.clients;
+	Client *target = s->clients;
+	s->clients = target->next;
+	Client *dst = s->clients;
 	while (dst->next)
 		dst = dst->next;
 	target->next = NULL;
 	dst->next = target;
 }
 
-static void server_mark_socket_exec(bool exec, bool usr) {
+static void server_mark_socket_exec(Server *s, bool exec, bool usr) {
 	struct stat sb;
-	if (stat(sockaddr.sun_path, &sb) == -1)
+	/* the status page tells as well, touching it notifies watchers (-w) */
+	if (SOCKET_ABSTRACT) {
+		if (s->status != &s->status_private)
+			futimens(s->status_fd, NULL);
+		return;
+	}
+	if (stat(s->path, &sb) == -1)
 		return;
 	mode_t mode = sb.st_mode;
 	mode_t flag = usr ? S_IXUSR : S_IXGRP;
@@ -40,18 +178,32 @@ static void server_mark_socket_exec(bool exec, bool usr) {
 		mode |= flag;
 	else
 		mode &= ~flag;
-	chmod(sockaddr.sun_path, mode);
+	chmod(s->path, mode);
+}
+
+static int server_set_cloexec(int fd) {
+	int flags;
+	if ((flags = fcntl(fd, F_GETFD, 0)) == -1)
+		flags = 0;
+	return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
 }
 
 static int server_create_socket(const char *name) {
 	if (!set_socket_name(&sockaddr, name))
 		return -1;
+	struct sockaddr_un addr;
+	socklen_t socklen = socket_address(&addr, sockaddr.sun_path);
+	if (!socklen)
+		return -1;
 	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (fd == -1)
 		return -1;
-	socklen_t socklen = offsetof(struct sockaddr_un, sun_path) + strlen(sockaddr.sun_path) + 1;
+	if (server_set_cloexec(fd) == -1) {
+		close(fd);
+		return -1;
+	}
 	mode_t mask = umask(S_IXUSR|S_IRWXG|S_IRWXO);
-	int r = bind(fd, (struct sockaddr*)&sockaddr, socklen);
+	int r = bind(fd, (struct sockaddr*)&addr, socklen);
 	umask(mask);
 
 	if (r == -1) {
@@ -60,7 +212,7 @@ static int server_create_socket(const char *name) {
 	}
 
 	if (listen(fd, 5) == -1) {
-		unlink(sockaddr.sun_path);
+		socket_unlink(sockaddr.sun_path);
 		close(fd);
 		return -1;
 	}
@@ -68,6 +220,38 @@ static int server_create_socket(const char *name) {
 	return fd;
 }
 
+static void server_create_status(Server *s) {
+	char path[PATH_MAX];
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	if (!status_path(path, sizeof path, s->path))
+		return;
+	int fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if (fd == -1)
+		return;
+	Status *status = MAP_FAILED;
+	if (ftruncate(fd, sizeof *status) == 0 && fcntl(fd, F_SETLK, &lock) == 0)
+		status = mmap(NULL, sizeof *status, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (status == MAP_FAILED) {
+		unlink(path);
+		close(fd);
+		return;
+	}
+	/* the descriptor stays open, closing it would release the lock */
+	*status = *s->status;
+	status->size = sizeof *status;
+	status->pid = getpid();
+	status->child = s->pid;
+	status->started = time(NULL);
+	if (s->requested)
+		status->startup = clock_us() - s->requested;
+	status->exit_status = s->exit_status;
+	status->magic = STATUS_MAGIC;
+	s->status = status;
+	s->status_fd = fd;
+	/* writes through the mapping go unnoticed by watchers (-w) */
+	futimens(fd, NULL);
+}
+
 static int server_set_socket_non_blocking(int sock) {
 	int flags;
 	if ((flags = fcntl(sock, F_GETFL, 0)) == -1)
@@ -75,81 +259,503 @@ static int server_set_socket_non_blocking(int sock) {
     	return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 }
 
-static bool server_read_pty(Packet *pkt) {
-	pkt->type = MSG_CONTENT;
-	ssize_t len = read(server.pty, pkt->u.msg, sizeof(pkt->u.msg));
+static long server_elapsed_us(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static long server_elapsed_ms(struct timespec *start) {
+	return server_elapsed_us(start) / 1000;
+}
+
+static long server_clock_ms(void) {
+	struct timespec zero = { 0 };
+	return server_elapsed_ms(&zero);
+}
+
+/* drain the pty into a batch, bounded in size and time */
+static bool server_read_pty(Server *s, Buffer *batch) {
+	size_t limit = s->pty_batch_limit;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	batch->start = batch->end = 0;
+	s->pty_read_at = clock_us();
+	if (s->ring && pty_ring_read(s, batch, limit)) {
+		s->status->pty_read += batch->end;
+		if (s->vt) {
+			vt_process(s->vt, batch->data, batch->end);
+			s->screen_valid = false;
+		}
+	}
+	while (!s->ring && batch->end < limit) {
+		if (!buffer_reserve(batch, limit - batch->end))
+			break;
+		char *data = batch->data + batch->end;
+		ssize_t len = read(s->pty, data, limit - batch->end);
+		s->status->pty_reads++;
+		if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK))
+			s->running = false;
+		if (len <= 0)
+			break;
+		batch->end += len;
+		s->status->pty_read += len;
+		if (s->vt) {
+			vt_process(s->vt, data, len);
+			s->screen_valid = false;
+		}
+		if (server_elapsed_ms(&start) >= PTY_BATCH_TIME)
+			break;
+	}
+	/* grow while the application keeps the batch filled, shrink once it calms down */
+	if (batch->end >= limit && limit < PTY_BATCH_MAX)
+		s->pty_batch_limit = MIN(2 * limit, PTY_BATCH_MAX);
+	else if (batch->end < limit / 4 && limit > PTY_BATCH_MIN)
+		s->pty_batch_limit = MAX(limit / 2, PTY_BATCH_MIN);
+	debug("server-read-pty: %zu bytes limit: %zu\n", buffer_len(batch), limit);
+	return buffer_len(batch) > 0;
+}
+
+/* write what the pty accepts right away, returns the number of bytes or -1 */
+static ssize_t server_write_pty_some(Server *s, const char *buf, size_t size) {
+	size_t written = 0;
+	while (written < size) {
+		ssize_t len = write(s->pty, buf + written, size - written);
+		if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			debug("server-write-pty: FAILED\n");
+			s->running = false;
+			return -1;
+		}
+		written += len;
+		s->status->pty_written += len;
+	}
+	return written;
+}
+
+/* write client input to the pty, whatever it does not accept is queued until
+ * it becomes writable instead of waiting for the application to read it */
+static bool server_write_pty(Server *s, const char *buf, size_t size) {
+	debug("server-write-pty: %zu bytes\n", size);
+	if (!s->running)
+		return false;
+	ssize_t len = 0;
+	if (!buffer_len(&s->pty_input) && (len = server_write_pty_some(s, buf, size)) == -1)
+		return false;
+	return buffer_append(&s->pty_input, buf + len, size - len);
+}
+
+static int server_client_events(Client *c) {
+	return (c->throttled ? 0 : EVENT_READ) | (queue_len(&c->output) ? EVENT_WRITE : 0);
+}
+
+static void server_throttle_client(Client *c, bool throttle) {
+	if (c->throttled == throttle || c->state == STATE_DISCONNECTED)
+		return;
+	debug("server-throttle: %d\n", throttle);
+	c->throttled = throttle;
+	if (event_mod(c->socket, server_client_events(c), c) == -1)
+		c->state = STATE_DISCONNECTED;
+}
+
+/* write out queued input once the pty became writable, resume reading
+ * from the clients once the application consumed half of it */
+static void server_flush_pty(Server *s) {
+	Buffer *input = &s->pty_input;
+	ssize_t len = s->running ? server_write_pty_some(s, input->data + input->start, buffer_len(input)) : -1;
 	if (len > 0)
-		pkt->len = len;
-	else if (len == 0)
-		server.running = false;
-	else if (len == -1 && errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK)
-		server.running = false;
-	print_packet("server-read-pty:", pkt);
-	return len > 0;
-}
-
-static bool server_write_pty(Packet *pkt) {
-	print_packet("server-write-pty:", pkt);
-	size_t size = pkt->len;
-	if (write_all(server.pty, pkt->u.msg, size) == size)
+		buffer_consume(input, len);
+	if (len == -1)
+		buffer_free(input);
+	if (buffer_len(input) > PTY_INPUT_MAX / 2)
+		return;
+	for (Client *c = s->clients; c; c = c->next)
+		server_throttle_client(c, false);
+}
+
+static bool server_read_client(Client *c) {
+	/* a whole frame of the negotiated size, e.g. of a paste, per wakeup */
+	ssize_t len = buffer_read(&c->input, c->socket, packet_header_size() + c->packet_max);
+	if (len > 0)
+		c->stats.received += len;
+	if (len > 0 || (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)))
 		return true;
-	debug("FAILED\n");
-	server.running = false;
+	debug("server-recv: FAILED\n");
+	c->state = STATE_DISCONNECTED;
 	return false;
 }
 
-static bool server_recv_packet(Client *c, Packet *pkt) {
-	if (recv_packet(c->socket, pkt)) {
+static bool server_recv_packet(Client *c, Packet *pkt, const char **payload) {
+	switch (buffer_packet(&c->input, pkt, c->packet_max, payload)) {
+	case 1:
 		print_packet("server-recv:", pkt);
 		return true;
+	case -1:
+		debug("server-recv: FAILED\n");
+		c->state = STATE_DISCONNECTED;
 	}
-	debug("server-recv: FAILED\n");
-	c->state = STATE_DISCONNECTED;
 	return false;
 }
 
-static bool server_send_packet(Client *c, Packet *pkt) {
-	print_packet("server-send:", pkt);
-	if (send_packet(c->socket, pkt))
-		return true;
+static void server_repaint_client(Client *c);
+
+static void server_check_congestion(Client *c) {
+	size_t len = queue_len(&c->output);
+	bool congested = c->congested ? len > QUEUE_LOW : len > QUEUE_HIGH;
+	if (congested == c->congested)
+		return;
+	c->congested = congested;
+	debug("server-congestion: %d pending: %zu\n", congested, client_pending(c));
+	if (congested && client_overflow_policy(c) == OVERFLOW_DISCONNECT)
+		c->state = STATE_DISCONNECTED;
+	bool stall = congested && client_overflow_policy(c) == OVERFLOW_BLOCK;
+	if (stall != c->stalled) {
+		c->stalled = stall;
+		c->source.server->stalled += stall ? 1 : -1;
+	}
+	/* output was dropped, bring the client back in sync */
+	if (!congested && client_overflow_policy(c) == OVERFLOW_DROP)
+		server_repaint_client(c);
+}
+
+/* queue data, referencing the shared copy if it is part of it */
+static bool server_queue(Client *c, const char *data, size_t len, Shared *shared) {
+	if (!shared || data < shared->data || data + len > shared->data + shared->len)
+		return queue_append_copy(&c->output, data, len);
+	if (!shared->chunk && !(shared->chunk = chunk_new(shared->data, shared->len, shared->len)))
+		return false;
+	return queue_append(&c->output, shared->chunk, data - shared->data, len);
+}
+
+/* account for n bytes of the iovec having been written and queue the rest */
+static bool server_sent(Client *c, struct iovec *iov, int count, ssize_t n, bool queued, Shared *shared) {
+	size_t len = 0;
+	if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		goto error;
+	if (n > 0)
+		c->stats.sent += len = n;
+	bool appended = false;
+	for (int i = 0; i < count; i++) {
+		size_t skip = MIN(len, iov[i].iov_len);
+		len -= skip;
+		if (skip == iov[i].iov_len)
+			continue;
+		if (!server_queue(c, (char*)iov[i].iov_base + skip, iov[i].iov_len - skip, shared))
+			goto error;
+		appended = true;
+	}
+	if (appended) {
+		c->stats.queue_max = MAX(c->stats.queue_max, queue_len(&c->output));
+		if (!queued && event_mod(c->socket, server_client_events(c), c) == -1)
+			goto error;
+		server_check_congestion(c);
+	}
+	return c->state != STATE_DISCONNECTED;
+error:
 	debug("FAILED\n");
 	c->state = STATE_DISCONNECTED;
 	return false;
 }
 
-static void server_pty_died_handler(int sig) {
-	int errsv = errno;
-	pid_t pid;
+static bool server_sendv(Client *c, struct iovec *iov, int count, Shared *shared) {
+	if (c->state == STATE_DISCONNECTED)
+		return false;
+	/* preserve the order of what is already queued */
+	bool queued = queue_len(&c->output) > 0;
+	return server_sent(c, iov, count, queued ? 0 : writev(c->socket, iov, count), queued, shared);
+}
 
-	while ((pid = waitpid(-1, &server.exit_status, WNOHANG)) != 0) {
-		if (pid == -1)
-			break;
-		server.exit_status = WEXITSTATUS(server.exit_status);
-		server_mark_socket_exec(true, false);
+static bool server_send(Client *c, const char *buf, size_t size) {
+	struct iovec iov = { .iov_base = (char*)buf, .iov_len = size };
+	return server_sendv(c, &iov, 1, NULL);
+}
+
+static bool server_send_packet(Client *c, Packet *pkt) {
+	print_packet("server-send:", pkt);
+	if (pkt->type == MSG_CONTENT && c->congested &&
+	    client_overflow_policy(c) == OVERFLOW_DROP) {
+		debug("server-send: DROPPED\n");
+		c->stats.dropped += pkt->len;
+		return false;
+	}
+	c->stats.packets++;
+	return server_send(c, (const char*)pkt, packet_size(pkt));
+}
+
+/* frame content according to the packet size the client negotiated, the
+ * content is part of the shared data, if given */
+static bool server_send_content(Client *c, const char *data, size_t len, Shared *shared) {
+	if (c->congested && client_overflow_policy(c) == OVERFLOW_DROP) {
+		debug("server-send: DROPPED %zu bytes\n", len);
+		c->stats.dropped += len;
+		return false;
+	}
+	uint32_t header[64][2];
+	struct iovec iov[2*countof(header)];
+	while (len > 0) {
+		int count = packet_iovec(header, countof(header), iov, MSG_CONTENT, &data, &len, c->packet_max);
+		c->stats.packets += count / 2;
+		if (!server_sendv(c, iov, count, shared))
+			return false;
 	}
+	return true;
+}
 
-	debug("server pty died: %d\n", server.exit_status);
-	errno = errsv;
+/* regenerate the repaint of the screen unless it is still current */
+static bool server_update_screen(Server *s) {
+	if (!s->vt)
+		return false;
+	/* the repaint is shared by all clients until the screen changes again */
+	if (!s->screen_valid) {
+		s->screen.start = s->screen.end = 0;
+		if (!vt_repaint(s->vt, &s->screen))
+			return false;
+		s->screen_valid = true;
+		chunk_unref(s->screen_chunk);
+		s->screen_chunk = NULL;
+		debug("server-repaint: %zu bytes\n", buffer_len(&s->screen));
+	}
+	return true;
+}
+
+static void server_repaint_client(Client *c) {
+	Server *s = c->source.server;
+	if (!server_update_screen(s))
+		return;
+	Shared shared = { s->screen.data, buffer_len(&s->screen), s->screen_chunk };
+	server_send_content(c, shared.data, shared.len, &shared);
+	s->screen_chunk = shared.chunk;
+}
+
+/* observers which asked for it get periodic repaints instead of all output */
+static bool client_conflated(Client *c) {
+	return c->refresh && c->source.server->vt && (c->flags & (CLIENT_READONLY|CLIENT_LOWPRIORITY));
+}
+
+/* send due repaints to conflated clients, returns the time until the next one */
+static int server_repaint_conflated(Server *s) {
+	int timeout = -1;
+	long now = server_clock_ms();
+	for (Client *c = s->clients; c; c = c->next) {
+		/* wait until the previous repaint was written out */
+		if (!c->dirty || queue_len(&c->output) || c->state == STATE_DISCONNECTED)
+			continue;
+		if (now < c->repaint_at) {
+			int wait = c->repaint_at - now;
+			timeout = timeout == -1 ? wait : MIN(timeout, wait);
+			continue;
+		}
+		server_repaint_client(c);
+		c->dirty = false;
+		/* align to a common tick, such that clients share the same repaint */
+		long interval = MAX(1000 / c->refresh, 1);
+		c->repaint_at = (now / interval + 1) * interval;
+	}
+	return timeout;
+}
+
+/* account for len bytes of the queued output having been written */
+static void server_flushed(Client *c, ssize_t len) {
+	if (len == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			c->state = STATE_DISCONNECTED;
+		return;
+	}
+	queue_consume(&c->output, len);
+	c->stats.sent += len;
+	if (!queue_len(&c->output) && event_mod(c->socket, server_client_events(c), c) == -1)
+		c->state = STATE_DISCONNECTED;
+	server_check_congestion(c);
+}
+
+/* write out the queued output of all clients which became writable */
+static void server_flush_clients(Event *events, int n) {
+	/* kept off the stack, the main loop is their only user */
+	static Client *clients[SERVER_EVENTS];
+	static struct iovec iov[SERVER_EVENTS][16];
+	static EventWrite writes[SERVER_EVENTS];
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		Source *src = events[i].data;
+		if (src->type != SOURCE_CLIENT || !(events[i].events & EVENT_WRITE))
+			continue;
+		Client *c = (Client*)src;
+		if (c->state == STATE_DISCONNECTED)
+			continue;
+		if (!queue_len(&c->output)) {
+			server_flushed(c, 0);
+			continue;
+		}
+		int segments = queue_iovec(&c->output, iov[count], countof(iov[count]));
+		writes[count] = (EventWrite){ .fd = c->socket, .iov = iov[count], .count = segments };
+		clients[count++] = c;
+	}
+	event_writev(writes, count);
+	for (int i = 0; i < count; i++) {
+		errno = writes[i].error;
+		server_flushed(clients[i], writes[i].result);
+	}
+}
+
+/* reply with the session counters followed by those of each client */
+static void server_send_stats(Client *c) {
+	Server *s = c->source.server;
+	Packet pkt = { .type = MSG_STATS, .len = sizeof pkt.u.status };
+	pkt.u.status = *s->status;
+	pkt.u.status.clients = 0;
+	for (Client *i = s->clients; i; i = i->next)
+		pkt.u.status.clients += i->attached;
+	server_send_packet(c, &pkt);
+	for (Client *i = s->clients; i; i = i->next) {
+		if (!i->attached)
+			continue;
+		pkt.len = sizeof pkt.u.client;
+		pkt.u.client = i->stats;
+		pkt.u.client.flags = i->flags;
+		pkt.u.client.state = i->state;
+		pkt.u.client.queued = client_pending(i);
+		server_send_packet(c, &pkt);
+	}
+}
+
+/* tell a client which asked for it when its last input was processed */
+static void server_send_timing(Client *c) {
+	Packet pkt = {
+		.type = MSG_TIMING,
+		.len = sizeof pkt.u.timing,
+		.u.timing = {
+			.received = c->input_at,
+			.written = c->written_at,
+			.read = c->source.server->pty_read_at,
+			.sent = clock_us(),
+		},
+	};
+	c->written_at = 0;
+	server_send_packet(c, &pkt);
+}
+
+static void server_pty_died_handler(int sig) {
+	server.child_died = true;
 }
 
 static void server_sigterm_handler(int sig) {
 	exit(EXIT_FAILURE); /* invoke atexit handler */
 }
 
-static Client *server_accept_client(void) {
-	int newfd = accept(server.socket, NULL, NULL);
-	if (newfd == -1 || server_set_socket_non_blocking(newfd) == -1)
+static void server_activate(Server *s) {
+	if (s->active)
+		return;
+	s->active = true;
+	s->next_active = servers_active;
+	servers_active = s;
+}
+
+/* whether the session is a warm one waiting to be claimed */
+static bool server_pooled(Server *s) {
+	const char *name = strrchr(s->path, '/');
+	return !strncmp(name ? name + 1 : s->path, POOL_PREFIX, strlen(POOL_PREFIX));
+}
+
+/* collect the exit status of terminated commands */
+static void server_reap_children(void) {
+	int status;
+	pid_t pid;
+	server.child_died = false;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (Server *s = servers; s; s = s->next) {
+			if (s->pid != pid)
+				continue;
+			s->exit_status = WEXITSTATUS(status);
+			s->status->exit_status = s->exit_status;
+			server_mark_socket_exec(s, true, false);
+			/* nobody is going to ask for the exit status of a warm session */
+			if (server_pooled(s))
+				s->exit_delivered = true;
+			server_activate(s);
+			debug("server pty died: %d\n", s->exit_status);
+		}
+	}
+}
+
+/* keep the most recent output, the ring is allocated once output arrives */
+static void server_history_append(Server *s, const char *data, size_t len) {
+	if (!HISTORY_SIZE || (!s->history && !(s->history = malloc(HISTORY_SIZE))))
+		return;
+	if (len > HISTORY_SIZE) {
+		s->history_len += len - HISTORY_SIZE;
+		data += len - HISTORY_SIZE;
+		len = HISTORY_SIZE;
+	}
+	size_t offset = s->history_len % HISTORY_SIZE, first = MIN(len, HISTORY_SIZE - offset);
+	memcpy(s->history + offset, data, first);
+	memcpy(s->history, data + first, len - first);
+	s->history_len += len;
+}
+
+/* describe the reply to a tail query for the last len bytes of output, all
+ * that is kept if zero, returns the number of iovecs filled in */
+static int server_tail_iovec(Server *s, Packet *reply, uint64_t len, struct iovec iov[3]) {
+	uint64_t kept = s->history ? MIN(s->history_len, HISTORY_SIZE) : 0;
+	if (!len || len > kept)
+		len = kept;
+	*reply = (Packet){ .type = MSG_TAIL, .len = sizeof reply->u.l, .u.l = len };
+	iov[0] = (struct iovec){ .iov_base = reply, .iov_len = packet_size(reply) };
+	if (!len)
+		return 1;
+	size_t offset = (s->history_len - len) % HISTORY_SIZE, first = MIN(len, HISTORY_SIZE - offset);
+	iov[1] = (struct iovec){ .iov_base = s->history + offset, .iov_len = first };
+	iov[2] = (struct iovec){ .iov_base = s->history, .iov_len = len - first };
+	return 3;
+}
+
+/* Answer a tail query (-t) which arrived along with the connection, without
+ * setting up a client. Returns false if the connection is to be served as a
+ * client instead, because the request is not there yet or the reply might
+ * not fit into the socket buffer at once. */
+static bool server_tail_query(Server *s, int fd) {
+	Packet pkt, reply;
+	struct iovec iov[3];
+	int sndbuf;
+	socklen_t optlen = sizeof sndbuf;
+	ssize_t size = packet_header_size() + sizeof pkt.u.l;
+	if (recv(fd, &pkt, size, MSG_PEEK) != size || pkt.type != MSG_TAIL || pkt.len != sizeof pkt.u.l)
+		return false;
+	int count = server_tail_iovec(s, &reply, pkt.u.l, iov);
+	/* leave room for the bookkeeping the kernel charges to the buffer */
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) == -1 ||
+	    packet_size(&reply) + reply.u.l > (size_t)sndbuf / 2)
+		return false;
+	print_packet("server-recv:", &pkt);
+	recv(fd, &pkt, size, 0);
+	if (writev(fd, iov, count) == -1)
+		debug("server-tail: %s\n", strerror(errno));
+	close(fd);
+	return true;
+}
+
+static Client *server_accept_client(Server *s) {
+	int newfd = accept(s->socket, NULL, NULL);
+	if (newfd == -1 || !socket_peer_trusted(newfd) ||
+	    server_set_socket_non_blocking(newfd) == -1 || server_set_cloexec(newfd) == -1)
 		goto error;
-	Client *c = client_malloc(newfd);
+	if (server_tail_query(s, newfd))
+		return NULL;
+	Client *c = client_malloc(s, newfd);
 	if (!c)
 		goto error;
-	if (!server.clients)
-		server_mark_socket_exec(true, true);
+	if (event_add(newfd, EVENT_READ, c) == -1) {
+		free(c);
+		goto error;
+	}
+	static uint32_t id;
 	c->socket = newfd;
 	c->state = STATE_CONNECTED;
-	c->next = server.clients;
-	server.clients = c;
-	server.read_pty = true;
+	c->stats.id = ++id;
+	c->next = s->clients;
+	s->clients = c;
 
 	Packet pkt = {
 		.type = MSG_PID,
@@ -157,7 +763,6 @@ static Client *server_accept_client(void) {
 		.u.l = getpid(),
 	};
 	server_send_packet(c, &pkt);
-
 	return c;
 error:
 	if (newfd != -1)
@@ -166,130 +771,809 @@ error:
 }
 
 static void server_sigusr1_handler(int sig) {
-	int socket = server_create_socket(server.session_name);
+	server.socket_renew = true;
+}
+
+static void server_renew_socket(Server *s) {
+	int socket = server_create_socket(s->path);
+	if (socket == -1)
+		return;
+	if (event_add(socket, EVENT_READ, &s->socket_source) == -1) {
+		close(socket);
+		return;
+	}
+	if (s->socket) {
+		event_del(s->socket);
+		close(s->socket);
+	}
+	s->socket = socket;
+}
+
+static void server_watch_pty(Server *s) {
+	bool watch = s->running && s->read_pty && !s->stalled;
+	/* with a reader thread, its notifications take the place of the pty */
+	if (s->ring && watch != s->pty_watched) {
+		if (watch && event_add(s->ring->notify[0], EVENT_READ, &s->pty_source) == -1)
+			die("server-watch-pty");
+		if (!watch)
+			event_del(s->ring->notify[0]);
+	}
+	s->pty_watched = watch;
+	int events = (watch && !s->ring ? EVENT_READ : 0) |
+	             (s->running && buffer_len(&s->pty_input) ? EVENT_WRITE : 0);
+	if (events == s->pty_events)
+		return;
+	int ret = 0;
+	if (!events)
+		event_del(s->pty);
+	else if (s->pty_events)
+		ret = event_mod(s->pty, events, &s->pty_source);
+	else
+		ret = event_add(s->pty, events, &s->pty_source);
+	if (ret == -1)
+		die("server-watch-pty");
+	s->pty_events = events;
+}
+
+static void server_sweep_clients(Server *s) {
+	for (Client **prev_next = &s->clients, *c = s->clients; c;) {
+		if (c->state != STATE_DISCONNECTED) {
+			prev_next = &c->next;
+			c = c->next;
+			continue;
+		}
+		bool first = (c == s->clients), attached = c->attached;
+		Client *t = c->next;
+		event_del(c->socket);
+		client_free(c);
+		*prev_next = c = t;
+		if (first && s->clients) {
+			Packet pkt = {
+				.type = MSG_RESIZE,
+				.len = 0,
+			};
+			server_send_packet(s->clients, &pkt);
+		}
+		if (attached && --s->status->clients == 0) {
+			server_mark_socket_exec(s, false, true);
+			/* regenerated upon the next attach, detached sessions stay small */
+			buffer_free(&s->screen);
+			chunk_unref(s->screen_chunk);
+			s->screen_chunk = NULL;
+			s->screen_valid = false;
+		}
+		server.released = true;
+	}
+}
+
+/* Move a warm session to the socket path requested by the claiming client and
+ * reply with an error message, which is empty on success. */
+static void server_claim(Client *c, const char *path, size_t len) {
+	Server *s = c->source.server;
+	char name[sizeof(s->path)], status[PATH_MAX], claimed[PATH_MAX];
+	Packet pkt = { .type = MSG_CLAIM };
+	int socket = -1;
+
+	if (!server_pooled(s) || !s->running || s->exit_status != -1 || len == 0 ||
+	    len >= sizeof name || memchr(path, '\0', len)) {
+		errno = EINVAL;
+		goto error;
+	}
+	memcpy(name, path, len);
+	name[len] = '\0';
+	/* fails if a session of that name exists */
+	if ((socket = server_create_socket(name)) == -1)
+		goto error;
+	if (event_add(socket, EVENT_READ, &s->socket_source) == -1)
+		goto error;
+	if (s->status != &s->status_private && status_path(status, sizeof status, s->path) &&
+	    status_path(claimed, sizeof claimed, name))
+		rename(status, claimed);
+	socket_unlink(s->path);
+	event_del(s->socket);
+	close(s->socket);
+	s->socket = socket;
+	memcpy(s->path, name, sizeof s->path);
+	s->status->started = time(NULL);
+	server_mark_socket_exec(s, true, true);
+	server_send_packet(c, &pkt);
+	return;
+error:
+	snprintf(pkt.u.msg, sizeof pkt.u.msg, "server-claim: %s\n", strerror(errno));
+	pkt.len = strlen(pkt.u.msg);
+	server_send_packet(c, &pkt);
 	if (socket != -1) {
-		if (server.socket)
-			close(server.socket);
-		server.socket = socket;
+		socket_unlink(name);
+		close(socket);
 	}
 }
 
-static void server_atexit_handler(void) {
-	unlink(sockaddr.sun_path);
+static void server_handle_packet(Client *c, Packet *pkt, const char *payload) {
+	Server *s = c->source.server;
+	switch (pkt->type) {
+	case MSG_CONTENT:
+		if (c->caps & CAP_TIMESTAMPS)
+			c->input_at = clock_us();
+		server_write_pty(s, payload, pkt->len);
+		if (c->caps & CAP_TIMESTAMPS)
+			c->written_at = clock_us();
+		if (buffer_len(&s->pty_input) >= PTY_INPUT_MAX)
+			server_throttle_client(c, true);
+		break;
+	case MSG_HELLO:
+		c->packet_max = MAX(MIN(pkt->u.hello.max, PACKET_MAX), PACKET_LEGACY_MAX);
+		pkt->u.hello.version = MIN(pkt->u.hello.version, PROTOCOL_VERSION);
+		pkt->u.hello.max = c->packet_max;
+		c->caps = pkt->u.hello.caps & CAP_TIMESTAMPS;
+		pkt->u.hello.caps = c->caps;
+		server_send_packet(c, pkt);
+		break;
+	case MSG_ATTACH:
+		c->flags = pkt->u.attach.flags;
+		if (pkt->len >= sizeof(pkt->u.attach))
+			c->refresh = MIN(pkt->u.attach.refresh, 1000);
+		if (c->flags & CLIENT_LOWPRIORITY)
+			server_sink_client(s);
+		if (c->attached)
+			break;
+		c->attached = true;
+		/* after the page was updated, for those watching it */
+		if (s->status->clients++ == 0)
+			server_mark_socket_exec(s, true, true);
+		s->read_pty = true;
+		/* bring the client up to date, it receives all further output */
+		if (s->running)
+			server_repaint_client(c);
+		break;
+	case MSG_STATS:
+		/* keep monitors from taking over the primary position */
+		if (!c->monitor && c == s->clients)
+			server_sink_client(s);
+		c->monitor = true;
+		server_send_stats(c);
+		break;
+	case MSG_RESIZE:
+		if (c->state != STATE_DISCONNECTED)
+			c->state = STATE_ATTACHED;
+		if (!(c->flags & CLIENT_READONLY) && c == s->clients) {
+			debug("server-ioct: TIOCSWINSZ\n");
+			struct winsize ws = { 0 };
+			ws.ws_row = pkt->u.ws.rows;
+			ws.ws_col = pkt->u.ws.cols;
+			ioctl(s->pty, TIOCSWINSZ, &ws);
+			if (s->vt) {
+				vt_resize(s->vt, ws.ws_row, ws.ws_col);
+				s->screen_valid = false;
+			}
+			if (s->recorder)
+				record_resize(s->recorder, &ws);
+		}
+		kill(-s->pid, SIGWINCH);
+		break;
+	case MSG_CLAIM:
+		server_claim(c, payload, pkt->len);
+		break;
+	case MSG_TAIL:
+		/* as for statistics, the client neither gets output nor controls the size */
+		if (!c->monitor && c == s->clients)
+			server_sink_client(s);
+		c->monitor = true;
+		if (pkt->len == sizeof pkt->u.l) {
+			Packet reply;
+			struct iovec iov[3];
+			server_sendv(c, iov, server_tail_iovec(s, &reply, pkt->u.l, iov), NULL);
+		}
+		break;
+	case MSG_EXIT:
+		s->exit_delivered = true;
+		/* fall through */
+	case MSG_DETACH:
+		c->state = STATE_DISCONNECTED;
+		break;
+	default: /* ignore package */
+		break;
+	}
 }
 
-static void server_mainloop(void) {
-	atexit(server_atexit_handler);
-	fd_set new_readfds, new_writefds;
-	FD_ZERO(&new_readfds);
-	FD_ZERO(&new_writefds);
-	FD_SET(server.socket, &new_readfds);
-	int new_fdmax = server.socket;
-	bool exit_packet_delivered = false;
-
-	if (server.read_pty)
-		FD_SET_MAX(server.pty, &new_readfds, new_fdmax);
-
-	while (server.clients || !exit_packet_delivered) {
-		int fdmax = new_fdmax;
-		fd_set readfds = new_readfds;
-		fd_set writefds = new_writefds;
-		FD_SET_MAX(server.socket, &readfds, fdmax);
-
-		if (select(fdmax+1, &readfds, &writefds, NULL, NULL) == -1) {
-			if (errno == EINTR)
+/* Send what was read from the pty to all clients. The writes to those without
+ * queued output are issued together, in a single system call if the event
+ * backend supports it. Whatever the clients can not take right away is copied
+ * once and referenced by all their queues. */
+static void server_fanout(Server *s, Buffer *batch) {
+	Shared shared = { batch->data, buffer_len(batch), NULL };
+	struct {
+		Client *client;
+		uint32_t header[4][2];
+		struct iovec iov[2*4];
+	} pending[64];
+	EventWrite writes[countof(pending)];
+	Client *c = s->clients;
+	while (c) {
+		int n = 0;
+		for (; c && n < countof(pending); c = c->next) {
+			if (!c->attached)
+				continue;
+			if (c->written_at)
+				server_send_timing(c);
+			if (client_conflated(c)) {
+				c->dirty = true;
+				continue;
+			}
+			const char *data = batch->data;
+			size_t len = buffer_len(batch);
+			int count = 0;
+			if (c->state != STATE_DISCONNECTED && !queue_len(&c->output))
+				count = packet_iovec(pending[n].header, countof(pending[n].header),
+				                     pending[n].iov, MSG_CONTENT, &data, &len, c->packet_max);
+			if (!count || len > 0) {
+				server_send_content(c, shared.data, shared.len, &shared);
 				continue;
-			die("server-mainloop");
+			}
+			c->stats.packets += count / 2;
+			pending[n].client = c;
+			writes[n] = (EventWrite){ .fd = c->socket, .iov = pending[n].iov, .count = count };
+			n++;
+		}
+		event_writev(writes, n);
+		for (int i = 0; i < n; i++) {
+			errno = writes[i].error;
+			server_sent(pending[i].client, pending[i].iov, writes[i].count, writes[i].result, false, &shared);
 		}
+	}
+	chunk_unref(shared.chunk);
+}
 
-		FD_ZERO(&new_readfds);
-		FD_ZERO(&new_writefds);
-		new_fdmax = server.socket;
-
-		bool pty_data = false;
-
-		Packet server_packet, client_packet;
-
-		if (FD_ISSET(server.socket, &readfds))
-			server_accept_client();
-
-		if (FD_ISSET(server.pty, &readfds))
-			pty_data = server_read_pty(&server_packet);
-
-		for (Client **prev_next = &server.clients, *c = server.clients; c;) {
-			if (FD_ISSET(c->socket, &readfds) && server_recv_packet(c, &client_packet)) {
-				switch (client_packet.type) {
-				case MSG_CONTENT:
-					server_write_pty(&client_packet);
-					break;
-				case MSG_ATTACH:
-					c->flags = client_packet.u.i;
-					if (c->flags & CLIENT_LOWPRIORITY)
-						server_sink_client();
-					break;
-				case MSG_RESIZE:
-					c->state = STATE_ATTACHED;
-					if (!(c->flags & CLIENT_READONLY) && c == server.clients) {
-						debug("server-ioct: TIOCSWINSZ\n");
-						struct winsize ws = { 0 };
-						ws.ws_row = client_packet.u.ws.rows;
-						ws.ws_col = client_packet.u.ws.cols;
-						ioctl(server.pty, TIOCSWINSZ, &ws);
-					}
-					kill(-server.pid, SIGWINCH);
-					break;
-				case MSG_EXIT:
-					exit_packet_delivered = true;
-					/* fall through */
-				case MSG_DETACH:
-					c->state = STATE_DISCONNECTED;
-					break;
-				default: /* ignore package */
-					break;
-				}
-			}
+/* append a batch to the recording, followed by a keyframe once one is due */
+static void server_record(Server *s, Buffer *batch) {
+	record_output(s->recorder, batch->data, buffer_len(batch));
+	/* the screen already reflects the batch, a replay starting at the
+	 * keyframe continues with the output recorded after it */
+	if (record_keyframe_due(s->recorder) && server_update_screen(s))
+		record_keyframe(s->recorder, s->screen.data + s->screen.start, buffer_len(&s->screen));
+}
+
+/* Forward what was read from the pty of a session which had events, or is due
+ * for a repaint, and deliver the exit status once the command terminated.
+ * Returns the milliseconds after which the session wants to be processed
+ * again even without further events, or -1. */
+static int server_process(Server *s, Buffer *batch) {
+	server_sweep_clients(s);
+
+	if (s->pty_writable || (!s->running && buffer_len(&s->pty_input)))
+		server_flush_pty(s);
+	s->pty_writable = false;
+
+	/* read the pty only after attaching clients have been repainted */
+	bool pty_data = s->pty_ready && server_read_pty(s, batch);
+	s->pty_ready = false;
+
+	if (pty_data)
+		server_fanout(s, batch);
+	if (pty_data)
+		server_history_append(s, batch->data, buffer_len(batch));
+	if (pty_data && s->recorder)
+		server_record(s, batch);
+	if (!s->running && s->exit_status != -1) {
+		for (Client *c = s->clients; c; c = c->next) {
+			if (c->exit_sent)
+				continue;
+			Packet pkt = {
+				.type = MSG_EXIT,
+				.u.i = s->exit_status,
+				.len = sizeof(pkt.u.i),
+			};
+			c->exit_sent = server_send_packet(c, &pkt);
+		}
+	}
+	if (pty_data || !s->running)
+		server_sweep_clients(s);
+
+	server_watch_pty(s);
+	/* poll until the exit status was collected */
+	int timeout = !s->running && s->exit_status == -1 ? 10 : -1;
+	/* the reader thread buffered more than fit into the batch, or
+	 * stopped notifying while reads were paused */
+	if (s->ring && s->pty_watched && pty_ring_pending(s->ring)) {
+		s->pty_ready = true;
+		timeout = 0;
+	}
+	if (s->running) {
+		int repaint = server_repaint_conflated(s);
+		if (repaint != -1 && (timeout == -1 || repaint < timeout))
+			timeout = repaint;
+	}
+	return timeout;
+}
+
+/* Executed in the child, which is attached to the pseudo terminal already.
+ * Returns only on failure after storing a message in error. */
+static void server_exec(char * const argv[], char **env, int cwd, char *error, size_t size) {
+	/* ignored signals would stay ignored across execvp(3) */
+	struct sigaction sa = { .sa_handler = SIG_DFL };
+	sigaction(SIGPIPE, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	if (cwd != -1 && fchdir(cwd) == -1) {
+		snprintf(error, size, "server-chdir: %s\n", strerror(errno));
+		return;
+	}
+	if (env)
+		environ = env;
+	execvp(argv[0], argv);
+	snprintf(error, size, "server-execvp: %s: %s\n", argv[0], strerror(errno));
+}
+
+#if defined(__linux__)
+/* Like forkpty(3), but vfork(2) neither copies the page tables nor does the
+ * parent have to wait for the child to be scheduled before it can exec. As
+ * the child borrows our memory, it must not run any of our signal handlers
+ * and its changes to environ are undone. */
+static pid_t server_forkpty(int *pty, struct termios *term, struct winsize *ws,
+                            char * const argv[], char **env, int cwd, int errfd,
+                            char *error, size_t size) {
+	static const int handled[] = { SIGCHLD, SIGTERM, SIGINT, SIGUSR1 };
+	char **env_orig = environ;
+	sigset_t all, mask;
+	int tty;
+	if (openpty(pty, &tty, NULL, term, ws) == -1)
+		return -1;
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK, &all, &mask);
+	pid_t pid = vfork();
+	if (pid == 0) {
+		struct sigaction sa = { .sa_handler = SIG_DFL };
+		for (unsigned int i = 0; i < countof(handled); i++)
+			sigaction(handled[i], &sa, NULL);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		if (setsid() == -1 || ioctl(tty, TIOCSCTTY, 0) == -1 ||
+		    dup2(tty, STDIN_FILENO) == -1 || dup2(tty, STDOUT_FILENO) == -1 ||
+		    dup2(tty, STDERR_FILENO) == -1) {
+			snprintf(error, size, "server-pty: %s\n", strerror(errno));
+		} else {
+			close(*pty);
+			if (tty > STDERR_FILENO)
+				close(tty);
+			server_exec(argv, env, cwd, error, size);
+		}
+		write_all(errfd, error, strlen(error));
+		_exit(EXIT_FAILURE);
+	}
+	int err = errno;
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	environ = env_orig;
+	close(tty);
+	if (pid == -1)
+		close(*pty);
+	errno = err;
+	return pid;
+}
+#else
+static pid_t server_forkpty(int *pty, struct termios *term, struct winsize *ws,
+                            char * const argv[], char **env, int cwd, int errfd,
+                            char *error, size_t size) {
+	pid_t pid = forkpty(pty, NULL, term, ws);
+	if (pid == 0) {
+		server_exec(argv, env, cwd, error, size);
+		write_all(errfd, error, strlen(error));
+		_exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+#endif
+
+/* Fork the command of a session on a new pseudo terminal. The environment is
+ * replaced by env and the working directory changed to cwd, if given. On
+ * failure a message is stored in error. */
+static bool server_spawn(Server *s, char * const argv[], char **env, int cwd,
+                         struct termios *term, char *error, size_t size) {
+	int pipefd[2];
+	if (pipe(pipefd) == -1 || server_set_cloexec(pipefd[0]) == -1 || server_set_cloexec(pipefd[1]) == -1) {
+		snprintf(error, size, "server-pipe: %s\n", strerror(errno));
+		return false;
+	}
+	s->pid = server_forkpty(&s->pty, term, &s->winsize, argv, env, cwd, pipefd[1], error, size);
+	if (s->pid == -1) {
+		snprintf(error, size, "server-forkpty: %s\n", strerror(errno));
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return false;
+	}
+	/* the pipe is closed upon a successful execvp(3) */
+	close(pipefd[1]);
+	ssize_t len = read_all(pipefd[0], error, size - 1);
+	close(pipefd[0]);
+	if (len > 0) {
+		error[len] = '\0';
+		close(s->pty);
+		return false;
+	}
+	return true;
+}
+
+/* start serving a session whose command was spawned */
+static bool server_add(Server *s) {
+	s->socket_source = (Source){ .type = SOURCE_SOCKET, .server = s };
+	s->pty_source = (Source){ .type = SOURCE_PTY, .server = s };
+	if (server_set_socket_non_blocking(s->pty) == -1 || server_set_cloexec(s->pty) == -1 ||
+	    event_add(s->socket, EVENT_READ, &s->socket_source) == -1)
+		return false;
+	s->vt = vt_create(s->winsize.ws_row, s->winsize.ws_col);
+	s->pty_batch_limit = PTY_BATCH_MIN;
+	/* before the reader thread which counts its reads on the page */
+	server_create_status(s);
+	if (PTY_THREAD)
+		pty_ring_start(s);
+	if (s->record_fd > 0) {
+		s->recorder = record_start(s->record_fd, s->record_flags, &s->winsize);
+		s->record_fd = 0;
+	}
+	s->prev = NULL;
+	s->next = servers;
+	if (servers)
+		servers->prev = s;
+	servers = s;
+	server_activate(s);
+	return true;
+}
+
+static void server_free(Server *s) {
+	char path[PATH_MAX];
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		servers = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	event_del(s->socket);
+	close(s->socket);
+	if (s->ring && s->pty_watched)
+		event_del(s->ring->notify[0]);
+	if (s->pty_events)
+		event_del(s->pty);
+	buffer_free(&s->pty_input);
+	pty_ring_free(s);
+	record_stop(s->recorder);
+	close(s->pty);
+	if (s->status != &s->status_private) {
+		if (status_path(path, sizeof path, s->path))
+			unlink(path);
+		munmap(s->status, sizeof *s->status);
+		close(s->status_fd);
+	}
+	socket_unlink(s->path);
+	vt_free(s->vt);
+	buffer_free(&s->screen);
+	chunk_unref(s->screen_chunk);
+	free(s->history);
+	if (s != &server)
+		free(s);
+	server.released = true;
+}
+
+/* return freed memory to the system, the allocator keeps it otherwise */
+static void server_trim(void) {
+	server.released = false;
+#if defined(__GLIBC__)
+	malloc_trim(0);
+#endif
+}
+
+static void server_request_close(Request *r) {
+	if (r->fd == -1)
+		return;
+	event_del(r->fd);
+	close(r->fd);
+	r->fd = -1;
+	for (int i = 0; i < 3; i++) {
+		if (r->fds[i] != -1)
+			close(r->fds[i]);
+		r->fds[i] = -1;
+	}
+	buffer_free(&r->input);
+}
+
+/* Release the requests which were answered or did not fully arrive before
+ * their deadline. Returns the timeout until the next deadline, or the given
+ * one if it is earlier. */
+static int server_request_expire(int timeout) {
+	long now = server_clock_ms();
+	for (Request **prev = &requests, *r; (r = *prev);) {
+		if (r->fd == -1 || r->deadline <= now) {
+			*prev = r->next;
+			server_request_close(r);
+			free(r);
+			continue;
+		}
+		if (timeout == -1 || r->deadline - now < timeout)
+			timeout = r->deadline - now;
+		prev = &r->next;
+	}
+	return timeout;
+}
+
+/* Accept a connection to the control socket of the daemon. The request is
+ * read as it arrives, like the packets of clients, such that a slow or stuck
+ * client holds up no session. */
+static void server_daemon_accept(void) {
+	int fd = accept(server.daemon, NULL, NULL);
+	if (fd == -1)
+		return;
+	Request *r = NULL;
+	if (!socket_peer_trusted(fd) || server_set_cloexec(fd) == -1 ||
+	    server_set_socket_non_blocking(fd) == -1 || !(r = calloc(1, sizeof *r))) {
+		close(fd);
+		return;
+	}
+	r->source = (Source){ .type = SOURCE_REQUEST };
+	r->fd = fd;
+	r->fds[0] = r->fds[1] = r->fds[2] = -1;
+	r->deadline = server_clock_ms() + PROBE_TIMEOUT;
+	if (event_add(fd, EVENT_READ, r) == -1) {
+		close(fd);
+		free(r);
+		return;
+	}
+	r->next = requests;
+	requests = r;
+}
+
+/* read what is available of a request and up to three descriptors passed
+ * along with it, returns false if the connection failed */
+static bool server_request_read(Request *r) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cmsg;
+	if (!buffer_reserve(&r->input, sizeof(Packet)))
+		return false;
+	struct iovec iov = { .iov_base = r->input.data + r->input.end, .iov_len = sizeof(Packet) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = &cmsg,
+		.msg_controllen = sizeof cmsg,
+	};
+	ssize_t len = recvmsg(r->fd, &msg, 0);
+	if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return true;
+	if (len <= 0)
+		return false;
+	r->input.end += len;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < count; i++) {
+			int received;
+			memcpy(&received, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+			if (i < 3 && r->fds[i] == -1 && server_set_cloexec(received) == 0)
+				r->fds[i] = received;
+			else
+				close(received);
+		}
+	}
+	return true;
+}
+
+/* the reply fits into the send buffer of the fresh connection, a client which
+ * does not read it is not waited for */
+static void server_request_reply(Request *r, const char *error) {
+	Packet pkt = { .type = MSG_CREATE, .len = strlen(error) };
+	memcpy(pkt.u.msg, error, pkt.len);
+	while (write(r->fd, &pkt, packet_size(&pkt)) == -1 && errno == EINTR);
+}
+
+/* Host a further session on behalf of a client connected to the daemon. The
+ * client passes the listening socket of the session, its working directory and
+ * the recording, the request holds the command line and environment. */
+static void server_request_create(Request *r, Packet *pkt, const char *payload) {
+	char error[255] = "", **args = NULL;
+	int *fds = r->fds;
+	Server *s = NULL;
+	struct sockaddr_un addr;
+	socklen_t addrlen = sizeof addr;
 
-			if (c->state == STATE_DISCONNECTED) {
-				bool first = (c == server.clients);
-				Client *t = c->next;
-				client_free(c);
-				*prev_next = c = t;
-				if (first && server.clients) {
-					Packet pkt = {
-						.type = MSG_RESIZE,
-						.len = 0,
-					};
-					server_send_packet(server.clients, &pkt);
-				} else if (!server.clients) {
-					server_mark_socket_exec(false, true);
-				}
+	if (pkt->type != MSG_CREATE || pkt->len < sizeof pkt->u.create || fds[0] == -1 ||
+	    pkt->u.create.argc == 0 || pkt->u.create.argc > pkt->len || pkt->u.create.envc > pkt->len ||
+	    (pkt->u.create.record && fds[1] == -1)) {
+		errno = EPROTO;
+		goto error;
+	}
+
+	uint32_t argc = pkt->u.create.argc, envc = pkt->u.create.envc;
+	if (!(args = calloc(argc + envc + 2, sizeof *args)) || !(s = calloc(1, sizeof *s)))
+		goto error;
+	char **env = args + argc + 1;
+	const char *arg = payload + sizeof pkt->u.create, *end = payload + pkt->len;
+	for (uint32_t i = 0; i < argc + envc; i++) {
+		const char *nul = memchr(arg, '\0', end - arg);
+		if (!nul) {
+			errno = EPROTO;
+			goto error;
+		}
+		args[i < argc ? i : i + 1] = (char*)arg;
+		arg = nul + 1;
+	}
+
+	s->running = true;
+	s->exit_status = -1;
+	s->status = &s->status_private;
+	s->socket = fds[0];
+	s->winsize = pkt->u.create.ws;
+	s->requested = pkt->u.create.requested;
+	s->read_pty = pkt->u.create.read_pty;
+	if (pkt->u.create.record) {
+		/* the working directory is left out if it could not be opened */
+		int last = fds[2] != -1 ? 2 : 1;
+		s->record_fd = fds[last];
+		s->record_flags = pkt->u.create.record_flags;
+		fds[last] = -1;
+	}
+	if (getsockname(s->socket, (struct sockaddr*)&addr, &addrlen) == -1 ||
+	    !socket_path(s->path, sizeof s->path, &addr, addrlen))
+		goto error;
+	if (!server_spawn(s, args, env, fds[1], pkt->u.create.has_term ? &pkt->u.create.term : NULL,
+	                  error, sizeof error))
+		goto reply;
+	if (!server_add(s)) {
+		close(s->pty);
+		goto error;
+	}
+	fds[0] = -1;
+	s = NULL;
+	goto reply;
+error:
+	snprintf(error, sizeof error, "server-daemon: %s\n", strerror(errno));
+reply:
+	server_request_reply(r, error);
+	if (s && s->record_fd > 0)
+		close(s->record_fd);
+	free(args);
+	free(s);
+}
+
+static void server_request_handle(Request *r) {
+	char error[255];
+	Packet pkt;
+	const char *payload;
+	if (!server_request_read(r)) {
+		server_request_close(r);
+		return;
+	}
+	switch (buffer_packet(&r->input, &pkt, PACKET_MAX, &payload)) {
+	case 0:
+		return;
+	case 1:
+		server_request_create(r, &pkt, payload);
+		break;
+	case -1:
+		errno = EPROTO;
+		snprintf(error, sizeof error, "server-daemon: %s\n", strerror(errno));
+		server_request_reply(r, error);
+		break;
+	}
+	/* freed once the main loop is done with the events of this wakeup */
+	server_request_close(r);
+}
+
+static void server_atexit_handler(void) {
+	char path[PATH_MAX];
+	struct sockaddr_un addr;
+	socklen_t addrlen = sizeof addr;
+	for (Server *s = servers; s; s = s->next) {
+		if (s->status != &s->status_private && status_path(path, sizeof path, s->path))
+			unlink(path);
+		socket_unlink(s->path);
+	}
+	if (server.daemon > 0 && getsockname(server.daemon, (struct sockaddr*)&addr, &addrlen) == 0 &&
+	    socket_path(path, sizeof path, &addr, addrlen))
+		socket_unlink(path);
+}
+
+/* Serve the given session and, if running as daemon, all further ones until
+ * each of them terminated and delivered its exit status. */
+static void server_mainloop(Server *session) {
+	atexit(server_atexit_handler);
+	Event events[SERVER_EVENTS];
+	Buffer batch = { 0 }; /* data read from a pty in one wakeup, shared by all sessions */
+
+	if (event_init() == -1 || !server_add(session))
+		die("server-mainloop");
+	if (server.daemon > 0 && event_add(server.daemon, EVENT_READ, &daemon_source) == -1)
+		die("server-mainloop");
+	struct timespec busy; /* each session is charged only the time spent on it */
+
+	while (servers) {
+		int timeout = -1;
+		for (Server **prev = &servers_active, *s; (s = *prev);) {
+			clock_gettime(CLOCK_MONOTONIC, &busy);
+			int wait = server_process(s, &batch);
+			s->status->busy += server_elapsed_us(&busy);
+			s->status->wakeups++;
+			if (wait == -1 || (!s->clients && s->exit_delivered)) {
+				*prev = s->next_active;
+				s->active = false;
+				if (!s->clients && s->exit_delivered)
+					server_free(s);
 				continue;
 			}
+			if (timeout == -1 || wait < timeout)
+				timeout = wait;
+			prev = &s->next_active;
+		}
+		if (!servers)
+			break;
+		timeout = server_request_expire(timeout);
+		/* idle, give back what the last burst of output needed */
+		if (timeout == -1 && batch.size > PTY_BATCH_MIN) {
+			buffer_free(&batch);
+			server.released = true;
+		}
+		if (timeout == -1 && server.released)
+			server_trim();
 
-			FD_SET_MAX(c->socket, &new_readfds, new_fdmax);
-
-			if (pty_data)
-				server_send_packet(c, &server_packet);
-			if (!server.running) {
-				if (server.exit_status != -1) {
-					Packet pkt = {
-						.type = MSG_EXIT,
-						.u.i = server.exit_status,
-						.len = sizeof(pkt.u.i),
-					};
-					if (!server_send_packet(c, &pkt))
-						FD_SET_MAX(c->socket, &new_writefds, new_fdmax);
-				} else {
-					FD_SET_MAX(c->socket, &new_writefds, new_fdmax);
-				}
+		int n = event_wait(events, countof(events), timeout);
+		if (n == -1) {
+			if (errno != EINTR)
+				die("server-mainloop");
+			n = 0;
+		}
+
+		if (server.socket_renew) {
+			server.socket_renew = false;
+			for (Server *s = servers; s; s = s->next)
+				server_renew_socket(s);
+		}
+		if (server.child_died)
+			server_reap_children();
+
+		for (int i = 0; i < n; i++) {
+			Source *src = events[i].data;
+			switch (src->type) {
+			case SOURCE_DAEMON:
+				server_daemon_accept();
+				break;
+			case SOURCE_REQUEST:
+				server_request_handle((Request*)src);
+				break;
+			case SOURCE_SOCKET:
+				server_activate(src->server);
+				server_accept_client(src->server);
+				break;
+			case SOURCE_PTY:
+				server_activate(src->server);
+				/* queued input is retried on any event, hangups are reported as readable */
+				if (events[i].events & EVENT_READ)
+					src->server->pty_ready = true;
+				if (buffer_len(&src->server->pty_input))
+					src->server->pty_writable = true;
+				break;
+			case SOURCE_CLIENT:
+				break;
 			}
-			prev_next = &c->next;
-			c = c->next;
 		}
 
-		if (server.running && server.read_pty)
-			FD_SET_MAX(server.pty, &new_readfds, new_fdmax);
+		if (n > 0)
+			server_flush_clients(events, n);
+		for (int i = 0; i < n; i++) {
+			Source *src = events[i].data;
+			if (src->type != SOURCE_CLIENT)
+				continue;
+			Client *c = (Client*)src;
+			Server *s = src->server;
+			server_activate(s);
+			clock_gettime(CLOCK_MONOTONIC, &busy);
+			if ((events[i].events & EVENT_READ) && c->state != STATE_DISCONNECTED &&
+			    server_read_client(c)) {
+				Packet client_packet;
+				const char *payload;
+				/* keep going after a failed send, a MSG_EXIT reply might be pending */
+				while (server_recv_packet(c, &client_packet, &payload))
+					server_handle_packet(c, &client_packet, payload);
+			}
+			s->status->busy += server_elapsed_us(&busy);
+		}
 	}
 
+	record_wait();
 	exit(EXIT_SUCCESS);
 }
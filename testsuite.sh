@@ -146,6 +146,309 @@ run_test_attached_detached() {
 	fi
 }
 
+# $1 => session-name
+run_test_list() {
+	check_environment || return 1;
+
+	local name="$1"
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+	echo -n "Running test: $name "
+
+	if $ABDUCO -n "$name" true >/dev/null 2>&1 && sleep 1 &&
+	   $ABDUCO | grep -q "^+ .*	$name\$" &&
+	   $ABDUCO -a "$name" >/dev/null 2>&1 && check_environment; then
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_stats() {
+	check_environment || return 1;
+
+	local name="$1"
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+	echo -n "Running test: $name "
+
+	if $ABDUCO -n "$name" sleep 2 >/dev/null 2>&1 &&
+	   $ABDUCO -S "$name" | grep -q "^$name	" && sleep 2 &&
+	   $ABDUCO -a "$name" >/dev/null 2>&1 && check_environment; then
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_daemon() {
+	check_environment || return 1;
+
+	local name="$1"
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+	echo -n "Running test: $name "
+
+	if $ABDUCO -D -n "$name-1" true >/dev/null 2>&1 &&
+	   $ABDUCO -D -n "$name-2" true >/dev/null 2>&1 && sleep 1 &&
+	   [ "`$ABDUCO | awk 'NR > 1 { print $(NF-1) }' | sort -u | wc -l`" -eq 1 ] &&
+	   $ABDUCO -a "$name-1" >/dev/null 2>&1 &&
+	   $ABDUCO -a "$name-2" >/dev/null 2>&1 && check_environment; then
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_pool() {
+	check_environment || return 1;
+
+	local name="$1"
+	local log="$PWD/$name.log"
+	local cmd="echo \$ABDUCO_SESSION \$POOL_TEST >> '$log'; sleep 3"
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+	echo -n "Running test: $name "
+
+	# only sessions created with -W are pooled, the second one fills the pool
+	# which is claimed by the fourth one but not by the third one, whose
+	# environment differs
+	rm -f "$log"
+	if ABDUCO_POOL=1 ABDUCO_CMD="$cmd" $ABDUCO -n "$name-1" >/dev/null 2>&1 && sleep 1 &&
+	   ! $ABDUCO -S | grep '^\.pool-' >/dev/null &&
+	   ABDUCO_POOL=1 ABDUCO_CMD="$cmd" $ABDUCO -W -n "$name-2" >/dev/null 2>&1 && sleep 1 &&
+	   $ABDUCO -S | grep '^\.pool-' >/dev/null &&
+	   POOL_TEST=other ABDUCO_POOL=1 ABDUCO_CMD="$cmd" $ABDUCO -W -n "$name-3" >/dev/null 2>&1 &&
+	   ABDUCO_POOL=1 ABDUCO_CMD="$cmd" $ABDUCO -W -n "$name-4" >/dev/null 2>&1 &&
+	   $ABDUCO | grep "	$name-4\$" >/dev/null && sleep 4 &&
+	   grep -x "$name-1" "$log" >/dev/null && grep -x "$name-2" "$log" >/dev/null &&
+	   grep -x "$name-3 other" "$log" >/dev/null && ! grep "^$name-4" "$log" >/dev/null &&
+	   $ABDUCO -a "$name-1" >/dev/null 2>&1 && $ABDUCO -a "$name-2" >/dev/null 2>&1 &&
+	   $ABDUCO -a "$name-3" >/dev/null 2>&1 && $ABDUCO -a "$name-4" >/dev/null 2>&1 &&
+	   check_environment; then
+		rm -f "$log"
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		rm -f "$log"
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_record() {
+	check_environment || return 1;
+
+	local name="$1"
+	local recording="$name.rec"
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+	echo -n "Running test: $name "
+
+	if $ABDUCO -n -R "$recording" "$name" sh -c 'echo Hello; sleep 1; echo World' >/dev/null 2>&1 &&
+	   sleep 2 && $ABDUCO -a "$name" >/dev/null 2>&1 &&
+	   [ "`$ABDUCO -P "$recording" 0 </dev/null | tr -d '\r'`" = "`printf 'Hello\nWorld'`" ] &&
+	   check_environment; then
+		rm -f "$recording"
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		rm -f "$recording"
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_tail() {
+	check_environment || return 1;
+
+	local name="$1"
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+	echo -n "Running test: $name "
+
+	if $ABDUCO -n "$name" sh -c 'echo Hello; echo World' >/dev/null 2>&1 && sleep 1 &&
+	   [ "`$ABDUCO -t "$name" 7 | tr -d '\r'`" = "World" ] &&
+	   $ABDUCO -a "$name" >/dev/null 2>&1 && check_environment; then
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_abstract() {
+	echo -n "Running test: $1 "
+	if [ "`uname`" != Linux ]; then
+		echo "SKIPPED"
+		return 0;
+	fi
+	check_environment || return 1;
+
+	local name="$1"
+	# the session exits with 7 if its socket is not in the file system
+	local cmd='sleep 1; [ -S "$ABDUCO_SOCKET" ] || exit 7'
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+
+	if ABDUCO_ABSTRACT=1 $ABDUCO -n "$name" sh -c "$cmd" >/dev/null 2>&1 &&
+	   ABDUCO_ABSTRACT=1 $ABDUCO | grep "$name" >/dev/null &&
+	   { ABDUCO_ABSTRACT=1 $ABDUCO -a "$name" >/dev/null 2>&1; [ $? -eq 7 ]; } &&
+	   check_environment; then
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_paste() {
+	check_environment || return 1;
+
+	local name="$1"
+	local output="$name.count"
+	local size=`seq 1 200000 | wc -c`
+	# the terminal is put into raw mode, lines are otherwise limited in length
+	local cmd="stty raw -echo; head -c $size | wc -c > $output"
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+	echo -n "Running test: $name "
+
+	if $ABDUCO -n "$name" sh -c "$cmd" >/dev/null 2>&1 && sleep 1 &&
+	   seq 1 200000 | $ABDUCO -a "$name" >/dev/null 2>&1 && sleep 2 &&
+	   [ "`cat "$output"`" -eq "$size" ] &&
+	   $ABDUCO -a "$name" >/dev/null 2>&1 && check_environment; then
+		rm -f "$output"
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		rm -f "$output"
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_narrow() {
+	echo -n "Running test: $1 "
+	# a terminal of the requested size is provided by script(1) of util-linux
+	if [ "`uname`" != Linux ] || ! command -v script >/dev/null 2>&1; then
+		echo "SKIPPED"
+		return 0;
+	fi
+	check_environment || return 1;
+
+	local name="$1"
+	# double width characters on a screen a single column wide, also in insert mode
+	local cmd='sleep 1; printf "\344\270\226\033[4h\347\225\214"; sleep 1; exit 3'
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+
+	if { LC_ALL=C.UTF-8 script -qec "stty cols 1 rows 5; $ABDUCO -c $name sh -c '$cmd'" \
+	     /dev/null >/dev/null 2>&1; [ $? -eq 3 ]; } && check_environment; then
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_stopped() {
+	echo -n "Running test: $1 "
+	if [ "`uname`" != Linux ] || ! command -v script >/dev/null 2>&1 ||
+	   ! command -v setsid >/dev/null 2>&1; then
+		echo "SKIPPED"
+		return 0;
+	fi
+	check_environment || return 1;
+
+	local name="$1"
+	local cmd='sleep 2; seq 1 200000; echo DONE; sleep 1'
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+
+	# a suspended client must not hold up the output to another one
+	$ABDUCO -n "$name" sh -c "$cmd" >/dev/null 2>&1
+	# in sessions of their own, job control would stop them as background processes
+	sleep 10 | setsid script -qec "$ABDUCO -a $name" /dev/null >/dev/null 2>&1 &
+	# script(1) stops itself along with the client
+	local terminal=$!
+	sleep 1
+	local stopped=`pgrep -f -x "$ABDUCO -a $name"`
+	[ -n "$stopped" ] && kill -STOP $stopped
+	local done=`sleep 10 | timeout 10 setsid script -qec "$ABDUCO -a $name" /dev/null 2>&1 | tr -d '\r' | grep -c '^DONE$'`
+	[ -n "$stopped" ] && kill -CONT $stopped $terminal
+	wait
+	sleep 1
+
+	if [ "$done" = 1 ] && check_environment; then
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		echo "FAIL"
+		return 1
+	fi
+}
+
+# $1 => session-name
+run_test_watch() {
+	check_environment || return 1;
+
+	local name="$1"
+	local output="$name.log"
+
+	TESTS_RUN=$((TESTS_RUN + 1))
+	echo -n "Running test: $name "
+
+	$ABDUCO -w >"$output" 2>&1 &
+	local watch=$!
+	sleep 1
+	$ABDUCO -n "$name" sh -c 'sleep 1; exit 5' >/dev/null 2>&1 && sleep 2 &&
+	   { $ABDUCO -a "$name" >/dev/null 2>&1; sleep 1; }
+	kill $watch
+	wait $watch 2>/dev/null
+
+	if grep "^add .*	$name\$" "$output" >/dev/null &&
+	   grep "^exit .*	$name	5\$" "$output" >/dev/null &&
+	   grep "^remove .*	$name\$" "$output" >/dev/null && check_environment; then
+		rm -f "$output"
+		TESTS_OK=$((TESTS_OK + 1))
+		echo "OK"
+		return 0
+	else
+		rm -f "$output"
+		echo "FAIL"
+		return 1
+	fi
+}
+
 run_test_dvtm() {
 	echo -n "Running dvtm test: "
 	if ! which dvtm >/dev/null 2>&1; then
@@ -210,6 +513,18 @@ run_test_attached_detached "attach-detach" "./long-running.sh"
 
 rm ./long-running.sh
 
+run_test_list "list"
+run_test_stats "stats"
+run_test_daemon "daemon"
+run_test_pool "pool"
+run_test_record "record"
+run_test_tail "tail"
+run_test_paste "paste"
+run_test_narrow "narrow"
+run_test_stopped "stopped"
+run_test_abstract "abstract"
+run_test_watch "watch"
+
 run_test_dvtm
 
 [ $TESTS_OK -eq $TESTS_RUN ]
@@ -0,0 +1,927 @@
+/* Minimal VT100/xterm screen model. It keeps track of the visible grid,
+ * cursor, modes and alternate screen of the session such that a freshly
+ * attached client can be brought up to date with a single repaint instead
+ * of waiting for the application to redraw itself. There is no scroll back
+ * history, memory usage is bounded by the size of the two screens. */
+
+#include <wchar.h>
+
+enum {
+	ATTR_BOLD      = 1 << 0,
+	ATTR_DIM       = 1 << 1,
+	ATTR_ITALIC    = 1 << 2,
+	ATTR_UNDERLINE = 1 << 3,
+	ATTR_BLINK     = 1 << 4,
+	ATTR_REVERSE   = 1 << 5,
+	ATTR_INVISIBLE = 1 << 6,
+	ATTR_STRIKE    = 1 << 7,
+};
+
+enum {
+	MODE_APPCURSOR   = 1 << 0,  /* ?1 */
+	MODE_ORIGIN      = 1 << 1,  /* ?6 */
+	MODE_AUTOWRAP    = 1 << 2,  /* ?7 */
+	MODE_HIDECURSOR  = 1 << 3,  /* ?25 */
+	MODE_MOUSE_X10   = 1 << 4,  /* ?9 */
+	MODE_MOUSE       = 1 << 5,  /* ?1000 */
+	MODE_MOUSE_DRAG  = 1 << 6,  /* ?1002 */
+	MODE_MOUSE_ALL   = 1 << 7,  /* ?1003 */
+	MODE_FOCUS       = 1 << 8,  /* ?1004 */
+	MODE_MOUSE_UTF8  = 1 << 9,  /* ?1005 */
+	MODE_MOUSE_SGR   = 1 << 10, /* ?1006 */
+	MODE_PASTE       = 1 << 11, /* ?2004 */
+	MODE_INSERT      = 1 << 12, /* 4 */
+	MODE_APPKEYPAD   = 1 << 13, /* ESC = */
+};
+
+static const struct {
+	int param;
+	int mode;
+} vt_private_modes[] = {
+	{    1, MODE_APPCURSOR  },
+	{    6, MODE_ORIGIN     },
+	{    7, MODE_AUTOWRAP   },
+	{    9, MODE_MOUSE_X10  },
+	{ 1000, MODE_MOUSE      },
+	{ 1002, MODE_MOUSE_DRAG },
+	{ 1003, MODE_MOUSE_ALL  },
+	{ 1004, MODE_FOCUS      },
+	{ 1005, MODE_MOUSE_UTF8 },
+	{ 1006, MODE_MOUSE_SGR  },
+	{ 2004, MODE_PASTE      },
+};
+
+/* colors: 0 is the terminal default, 1-256 a palette entry, otherwise RGB */
+#define COLOR_DEFAULT    0
+#define COLOR_INDEX(i)   ((uint32_t)(i) + 1)
+#define COLOR_RGB(r,g,b) (1u << 24 | (uint32_t)(r) << 16 | (uint32_t)(g) << 8 | (uint32_t)(b))
+
+typedef struct {
+	unsigned int ch : 21;   /* code point, 0 for the right half of wide characters */
+	unsigned int attr : 11;
+	uint32_t fg, bg;
+} Cell;
+
+typedef struct {
+	int row, col;
+	Cell pen;
+	int charset;
+	bool origin;
+} Cursor;
+
+typedef struct Vt {
+	Cell **lines[2];        /* main and (lazily allocated) alternate screen */
+	int alt;                /* index of the visible screen */
+	int rows, cols;
+	int row, col;
+	bool wrapnext;          /* cursor is past the last column */
+	int top, bottom;        /* scroll region */
+	int mode;
+	Cell pen;
+	bool graphics[2];       /* G0/G1 designated as DEC special graphics */
+	int charset;            /* invoked character set, i.e. G0 or G1 */
+	Cursor saved[2];
+	/* parser state */
+	enum {
+		VT_GROUND,
+		VT_ESC,
+		VT_ESC_CHARSET,
+		VT_CSI,
+		VT_STR,
+		VT_STR_ESC,
+	} state;
+	char prefix;            /* private marker of CSI sequence e.g. '?' */
+	char inter;             /* intermediate byte of CSI and ESC sequences */
+	int params[16];
+	int nparams;
+	uint32_t utf8;          /* partially decoded code point */
+	int utf8_len;           /* continuation bytes still expected */
+	bool touched;           /* whether any output was processed so far */
+} Vt;
+
+/* DEC special graphics for the range 0x5f - 0x7e */
+static const uint16_t vt_graphics[] = {
+	0x00a0, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0,
+	0x00b1, 0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c,
+	0x23ba, 0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534,
+	0x252c, 0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7,
+};
+
+static Cell vt_blank(Vt *vt) {
+	return (Cell){ .ch = ' ', .bg = vt->pen.bg };
+}
+
+static Cell *vt_line(Vt *vt, int row) {
+	return vt->lines[vt->alt][row];
+}
+
+/* a screen is an array of line pointers followed by the cells themselves,
+ * scrolling only has to shuffle the line pointers around */
+static Cell **vt_screen_alloc(int rows, int cols) {
+	Cell **lines = malloc(rows * sizeof(Cell*) + (size_t)rows * cols * sizeof(Cell));
+	if (!lines)
+		return NULL;
+	Cell *cells = (Cell*)(lines + rows);
+	for (int row = 0; row < rows; row++)
+		lines[row] = cells + (size_t)row * cols;
+	return lines;
+}
+
+static void vt_reverse_lines(Cell **lines, int from, int to) {
+	for (to--; from < to; from++, to--) {
+		Cell *tmp = lines[from];
+		lines[from] = lines[to];
+		lines[to] = tmp;
+	}
+}
+
+static void vt_clear(Vt *vt, int row, int col, int count) {
+	Cell *line = vt_line(vt, row), blank = vt_blank(vt);
+	for (int i = col; i < col + count && i < vt->cols; i++)
+		line[i] = blank;
+}
+
+static void vt_clear_rows(Vt *vt, int from, int to) {
+	for (int row = from; row < to; row++)
+		vt_clear(vt, row, 0, vt->cols);
+}
+
+static void vt_scroll(Vt *vt, int top, int bottom, int n) {
+	/* scroll region [top, bottom) up by n (or down by -n) lines */
+	int height = bottom - top;
+	if (height <= 0)
+		return;
+	if (n > height)
+		n = height;
+	if (n < -height)
+		n = -height;
+	/* rotate the line pointers, then clear the lines which scrolled in */
+	Cell **lines = vt->lines[vt->alt];
+	int shift = n > 0 ? n : height + n;
+	vt_reverse_lines(lines, top, top + shift);
+	vt_reverse_lines(lines, top + shift, bottom);
+	vt_reverse_lines(lines, top, bottom);
+	if (n > 0)
+		vt_clear_rows(vt, bottom - n, bottom);
+	else
+		vt_clear_rows(vt, top, top - n);
+}
+
+static void vt_moveto(Vt *vt, int row, int col) {
+	int top = 0, bottom = vt->rows - 1;
+	if (vt->mode & MODE_ORIGIN) {
+		top = vt->top;
+		bottom = vt->bottom - 1;
+		row += top;
+	}
+	vt->row = row < top ? top : row > bottom ? bottom : row;
+	vt->col = col < 0 ? 0 : col >= vt->cols ? vt->cols - 1 : col;
+	vt->wrapnext = false;
+}
+
+static void vt_linefeed(Vt *vt) {
+	if (vt->row == vt->bottom - 1)
+		vt_scroll(vt, vt->top, vt->bottom, 1);
+	else if (vt->row < vt->rows - 1)
+		vt->row++;
+}
+
+static void vt_reverse_linefeed(Vt *vt) {
+	if (vt->row == vt->top)
+		vt_scroll(vt, vt->top, vt->bottom, -1);
+	else if (vt->row > 0)
+		vt->row--;
+}
+
+static void vt_save_cursor(Vt *vt) {
+	vt->saved[vt->alt] = (Cursor){
+		.row = vt->row,
+		.col = vt->col,
+		.pen = vt->pen,
+		.charset = vt->charset,
+		.origin = vt->mode & MODE_ORIGIN,
+	};
+}
+
+static void vt_restore_cursor(Vt *vt) {
+	Cursor *c = &vt->saved[vt->alt];
+	vt->pen = c->pen;
+	vt->charset = c->charset;
+	if (c->origin)
+		vt->mode |= MODE_ORIGIN;
+	else
+		vt->mode &= ~MODE_ORIGIN;
+	vt->row = c->row < vt->rows ? c->row : vt->rows - 1;
+	vt->col = c->col < vt->cols ? c->col : vt->cols - 1;
+	vt->wrapnext = false;
+}
+
+static bool vt_alternate_screen(Vt *vt, bool alt) {
+	if (alt == vt->alt)
+		return true;
+	if (alt && !vt->lines[1]) {
+		vt->lines[1] = vt_screen_alloc(vt->rows, vt->cols);
+		if (!vt->lines[1])
+			return false;
+	}
+	vt->alt = alt;
+	return true;
+}
+
+static void vt_reset(Vt *vt) {
+	vt_alternate_screen(vt, false);
+	free(vt->lines[1]);
+	vt->lines[1] = NULL;
+	vt->pen = (Cell){ .ch = ' ' };
+	vt->mode = MODE_AUTOWRAP;
+	vt->top = 0;
+	vt->bottom = vt->rows;
+	vt->charset = 0;
+	vt->graphics[0] = vt->graphics[1] = false;
+	vt_clear_rows(vt, 0, vt->rows);
+	vt_moveto(vt, 0, 0);
+	vt_save_cursor(vt);
+	vt->saved[1] = vt->saved[0];
+}
+
+static Vt *vt_create(int rows, int cols) {
+	Vt *vt = calloc(1, sizeof(Vt));
+	if (!vt)
+		return NULL;
+	if (rows <= 0 || cols <= 0) {
+		rows = 25;
+		cols = 80;
+	}
+	vt->rows = rows;
+	vt->cols = cols;
+	vt->lines[0] = vt_screen_alloc(rows, cols);
+	if (!vt->lines[0]) {
+		free(vt);
+		return NULL;
+	}
+	vt_reset(vt);
+	return vt;
+}
+
+static void vt_free(Vt *vt) {
+	if (!vt)
+		return;
+	free(vt->lines[0]);
+	free(vt->lines[1]);
+	free(vt);
+}
+
+static bool vt_resize(Vt *vt, int rows, int cols) {
+	if (rows <= 0 || cols <= 0)
+		return false;
+	if (rows == vt->rows && cols == vt->cols)
+		return true;
+	Cell **lines[2] = { NULL, NULL };
+	for (int i = 0; i < 2; i++) {
+		if (!vt->lines[i])
+			continue;
+		lines[i] = vt_screen_alloc(rows, cols);
+		if (!lines[i]) {
+			free(lines[0]);
+			return false;
+		}
+	}
+	/* keep the bottom most lines around the cursor, like most terminals */
+	int shift = vt->row >= rows ? vt->row - rows + 1 : 0;
+	Cell blank = { .ch = ' ' };
+	for (int i = 0; i < 2; i++) {
+		if (!lines[i])
+			continue;
+		for (int row = 0; row < rows; row++) {
+			int r = row + (i == vt->alt ? shift : 0);
+			for (int col = 0; col < cols; col++) {
+				bool keep = r < vt->rows && col < vt->cols;
+				lines[i][row][col] = keep ? vt->lines[i][r][col] : blank;
+			}
+		}
+		free(vt->lines[i]);
+		vt->lines[i] = lines[i];
+	}
+	vt->rows = rows;
+	vt->cols = cols;
+	vt->top = 0;
+	vt->bottom = rows;
+	vt->row -= shift;
+	if (vt->col >= cols)
+		vt->col = cols - 1;
+	vt->wrapnext = false;
+	return true;
+}
+
+static void vt_put(Vt *vt, uint32_t ch) {
+	if (vt->graphics[vt->charset] && ch >= 0x5f && ch <= 0x7e)
+		ch = vt_graphics[ch - 0x5f];
+	int width = ch < 0x7f ? 1 : wcwidth(ch);
+	if (width == 0)
+		return; /* combining characters are not tracked */
+	/* a double width character does not fit on a screen one column wide */
+	if (width < 0 || width > vt->cols)
+		width = 1;
+	if (vt->wrapnext) {
+		vt->col = 0;
+		vt_linefeed(vt);
+		vt->wrapnext = false;
+	}
+	if (width > vt->cols - vt->col) {
+		if (!(vt->mode & MODE_AUTOWRAP))
+			return;
+		vt_clear(vt, vt->row, vt->col, width);
+		vt->col = 0;
+		vt_linefeed(vt);
+	}
+	Cell *line = vt_line(vt, vt->row);
+	if ((vt->mode & MODE_INSERT) && vt->col + width < vt->cols)
+		memmove(&line[vt->col + width], &line[vt->col], (vt->cols - vt->col - width) * sizeof(Cell));
+	Cell cell = vt->pen;
+	cell.ch = ch;
+	line[vt->col] = cell;
+	if (width == 2) {
+		cell.ch = 0;
+		line[vt->col + 1] = cell;
+	}
+	vt->col += width;
+	if (vt->col >= vt->cols) {
+		vt->col = vt->cols - 1;
+		vt->wrapnext = vt->mode & MODE_AUTOWRAP;
+	}
+}
+
+/* fast path for runs of printable ASCII, returns the number of bytes consumed */
+static size_t vt_put_ascii(Vt *vt, const unsigned char *s, const unsigned char *end) {
+	if ((vt->mode & MODE_INSERT) || vt->graphics[vt->charset])
+		return 0;
+	const unsigned char *p = s;
+	while (p < end && *p >= 0x20 && *p < 0x7f) {
+		if (vt->wrapnext) {
+			vt->col = 0;
+			vt_linefeed(vt);
+			vt->wrapnext = false;
+		}
+		Cell *line = vt_line(vt, vt->row), cell = vt->pen;
+		int col = vt->col;
+		for (; col < vt->cols && p < end && *p >= 0x20 && *p < 0x7f; p++) {
+			cell.ch = *p;
+			line[col++] = cell;
+		}
+		vt->col = col;
+		if (vt->col >= vt->cols) {
+			vt->col = vt->cols - 1;
+			vt->wrapnext = vt->mode & MODE_AUTOWRAP;
+		}
+	}
+	return p - s;
+}
+
+static void vt_control(Vt *vt, unsigned char c) {
+	switch (c) {
+	case '\b':
+		if (vt->col > 0)
+			vt->col--;
+		vt->wrapnext = false;
+		break;
+	case '\t':
+		vt->col = (vt->col / 8 + 1) * 8;
+		if (vt->col >= vt->cols)
+			vt->col = vt->cols - 1;
+		vt->wrapnext = false;
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		vt_linefeed(vt);
+		vt->wrapnext = false;
+		break;
+	case '\r':
+		vt->col = 0;
+		vt->wrapnext = false;
+		break;
+	case 0x0e: /* SO */
+		vt->charset = 1;
+		break;
+	case 0x0f: /* SI */
+		vt->charset = 0;
+		break;
+	case 0x18: /* CAN */
+	case 0x1a: /* SUB */
+		vt->state = VT_GROUND;
+		break;
+	case 0x1b:
+		vt->state = VT_ESC;
+		vt->inter = 0;
+		break;
+	}
+}
+
+static int vt_param(Vt *vt, int i, int def) {
+	return i < vt->nparams && vt->params[i] > 0 ? vt->params[i] : def;
+}
+
+static uint32_t vt_sgr_color(Vt *vt, int *i) {
+	int type = vt_param(vt, *i + 1, 0);
+	if (type == 5 && *i + 2 < vt->nparams) {
+		*i += 2;
+		return COLOR_INDEX(vt->params[*i] & 0xff);
+	} else if (type == 2 && *i + 4 < vt->nparams) {
+		*i += 4;
+		return COLOR_RGB(vt->params[*i-2] & 0xff, vt->params[*i-1] & 0xff, vt->params[*i] & 0xff);
+	}
+	*i = vt->nparams;
+	return COLOR_DEFAULT;
+}
+
+static void vt_sgr(Vt *vt) {
+	static const int attrs[] = {
+		[1] = ATTR_BOLD, [2] = ATTR_DIM, [3] = ATTR_ITALIC, [4] = ATTR_UNDERLINE,
+		[5] = ATTR_BLINK, [7] = ATTR_REVERSE, [8] = ATTR_INVISIBLE, [9] = ATTR_STRIKE,
+	};
+	Cell *pen = &vt->pen;
+	if (vt->nparams == 0)
+		vt->nparams = 1;
+	for (int i = 0; i < vt->nparams; i++) {
+		int p = vt->params[i];
+		if (p == 0) {
+			*pen = (Cell){ .ch = ' ' };
+		} else if (p < (int)countof(attrs)) {
+			pen->attr |= attrs[p];
+		} else if (p == 22) {
+			pen->attr &= ~(ATTR_BOLD|ATTR_DIM);
+		} else if (p >= 23 && p <= 29 && p - 20 < (int)countof(attrs)) {
+			pen->attr &= ~attrs[p - 20];
+		} else if (p >= 30 && p <= 37) {
+			pen->fg = COLOR_INDEX(p - 30);
+		} else if (p == 38) {
+			pen->fg = vt_sgr_color(vt, &i);
+		} else if (p == 39) {
+			pen->fg = COLOR_DEFAULT;
+		} else if (p >= 40 && p <= 47) {
+			pen->bg = COLOR_INDEX(p - 40);
+		} else if (p == 48) {
+			pen->bg = vt_sgr_color(vt, &i);
+		} else if (p == 49) {
+			pen->bg = COLOR_DEFAULT;
+		} else if (p >= 90 && p <= 97) {
+			pen->fg = COLOR_INDEX(p - 90 + 8);
+		} else if (p >= 100 && p <= 107) {
+			pen->bg = COLOR_INDEX(p - 100 + 8);
+		}
+	}
+}
+
+static void vt_set_mode(Vt *vt, bool set) {
+	for (int i = 0; i < vt->nparams; i++) {
+		int p = vt->params[i];
+		if (vt->prefix != '?') {
+			if (p == 4)
+				vt->mode = set ? vt->mode | MODE_INSERT : vt->mode & ~MODE_INSERT;
+			continue;
+		}
+		switch (p) {
+		case 25:
+			vt->mode = set ? vt->mode & ~MODE_HIDECURSOR : vt->mode | MODE_HIDECURSOR;
+			break;
+		case 47:
+		case 1047:
+			vt_alternate_screen(vt, set);
+			if (set)
+				vt_clear_rows(vt, 0, vt->rows);
+			break;
+		case 1048:
+			if (set)
+				vt_save_cursor(vt);
+			else
+				vt_restore_cursor(vt);
+			break;
+		case 1049:
+			if (set) {
+				vt_save_cursor(vt);
+				vt->saved[1] = vt->saved[0];
+				if (vt_alternate_screen(vt, true))
+					vt_clear_rows(vt, 0, vt->rows);
+			} else {
+				vt_alternate_screen(vt, false);
+				vt_restore_cursor(vt);
+			}
+			break;
+		default:
+			for (size_t j = 0; j < countof(vt_private_modes); j++) {
+				if (vt_private_modes[j].param != p)
+					continue;
+				if (set)
+					vt->mode |= vt_private_modes[j].mode;
+				else
+					vt->mode &= ~vt_private_modes[j].mode;
+			}
+			if (p == 6)
+				vt_moveto(vt, 0, 0);
+			break;
+		}
+	}
+}
+
+static void vt_csi(Vt *vt, unsigned char c) {
+	Cell *line = vt_line(vt, vt->row);
+	int n = vt_param(vt, 0, 1), limit;
+	if (vt->inter || (vt->prefix && vt->prefix != '?'))
+		return;
+	if (vt->prefix == '?' && c != 'h' && c != 'l')
+		return;
+	switch (c) {
+	case '@': /* ICH */
+		if (n > vt->cols - vt->col)
+			n = vt->cols - vt->col;
+		memmove(&line[vt->col + n], &line[vt->col], (vt->cols - vt->col - n) * sizeof(Cell));
+		vt_clear(vt, vt->row, vt->col, n);
+		break;
+	case 'A': /* CUU */
+	case 'F': /* CPL */
+		limit = vt->row >= vt->top ? vt->top : 0;
+		vt->row = vt->row - n < limit ? limit : vt->row - n;
+		if (c == 'F')
+			vt->col = 0;
+		vt->wrapnext = false;
+		break;
+	case 'B': /* CUD */
+	case 'e': /* VPR */
+	case 'E': /* CNL */
+		limit = vt->row < vt->bottom ? vt->bottom - 1 : vt->rows - 1;
+		vt->row = vt->row + n > limit ? limit : vt->row + n;
+		if (c == 'E')
+			vt->col = 0;
+		vt->wrapnext = false;
+		break;
+	case 'C': /* CUF */
+	case 'a': /* HPR */
+		vt->col = vt->col + n >= vt->cols ? vt->cols - 1 : vt->col + n;
+		vt->wrapnext = false;
+		break;
+	case 'D': /* CUB */
+		vt->col = vt->col - n < 0 ? 0 : vt->col - n;
+		vt->wrapnext = false;
+		break;
+	case 'G': /* CHA */
+	case '`': /* HPA */
+		vt->col = n > vt->cols ? vt->cols - 1 : n - 1;
+		vt->wrapnext = false;
+		break;
+	case 'H': /* CUP */
+	case 'f': /* HVP */
+		vt_moveto(vt, n - 1, vt_param(vt, 1, 1) - 1);
+		break;
+	case 'I': /* CHT */
+		while (n-- > 0)
+			vt_control(vt, '\t');
+		break;
+	case 'J': /* ED */
+		switch (vt_param(vt, 0, 0)) {
+		case 0:
+			vt_clear(vt, vt->row, vt->col, vt->cols);
+			vt_clear_rows(vt, vt->row + 1, vt->rows);
+			break;
+		case 1:
+			vt_clear_rows(vt, 0, vt->row);
+			vt_clear(vt, vt->row, 0, vt->col + 1);
+			break;
+		case 2:
+			vt_clear_rows(vt, 0, vt->rows);
+			break;
+		}
+		break;
+	case 'K': /* EL */
+		switch (vt_param(vt, 0, 0)) {
+		case 0:
+			vt_clear(vt, vt->row, vt->col, vt->cols);
+			break;
+		case 1:
+			vt_clear(vt, vt->row, 0, vt->col + 1);
+			break;
+		case 2:
+			vt_clear(vt, vt->row, 0, vt->cols);
+			break;
+		}
+		break;
+	case 'L': /* IL */
+	case 'M': /* DL */
+		if (vt->row >= vt->top && vt->row < vt->bottom) {
+			vt_scroll(vt, vt->row, vt->bottom, c == 'L' ? -n : n);
+			vt->col = 0;
+			vt->wrapnext = false;
+		}
+		break;
+	case 'P': /* DCH */
+		if (n > vt->cols - vt->col)
+			n = vt->cols - vt->col;
+		memmove(&line[vt->col], &line[vt->col + n], (vt->cols - vt->col - n) * sizeof(Cell));
+		vt_clear(vt, vt->row, vt->cols - n, n);
+		break;
+	case 'S': /* SU */
+		vt_scroll(vt, vt->top, vt->bottom, n);
+		break;
+	case 'T': /* SD */
+		vt_scroll(vt, vt->top, vt->bottom, -n);
+		break;
+	case 'X': /* ECH */
+		vt_clear(vt, vt->row, vt->col, n);
+		break;
+	case 'Z': /* CBT */
+		while (n-- > 0 && vt->col > 0)
+			vt->col = (vt->col - 1) / 8 * 8;
+		break;
+	case 'd': /* VPA */
+		vt_moveto(vt, n - 1, vt->col);
+		break;
+	case 'h': /* SM */
+	case 'l': /* RM */
+		vt_set_mode(vt, c == 'h');
+		break;
+	case 'm': /* SGR */
+		vt_sgr(vt);
+		break;
+	case 'r': /* DECSTBM */
+		n = vt_param(vt, 1, vt->rows);
+		if (n > vt->rows)
+			n = vt->rows;
+		if (vt_param(vt, 0, 1) < n) {
+			vt->top = vt_param(vt, 0, 1) - 1;
+			vt->bottom = n;
+			vt_moveto(vt, 0, 0);
+		}
+		break;
+	case 's': /* SCOSC */
+		vt_save_cursor(vt);
+		break;
+	case 'u': /* SCORC */
+		vt_restore_cursor(vt);
+		break;
+	}
+}
+
+static void vt_esc(Vt *vt, unsigned char c) {
+	vt->state = VT_GROUND;
+	switch (c) {
+	case '[':
+		vt->state = VT_CSI;
+		vt->prefix = vt->inter = 0;
+		vt->nparams = 0;
+		memset(vt->params, 0, sizeof(vt->params));
+		break;
+	case ']': /* OSC */
+	case 'P': /* DCS */
+	case 'X': /* SOS */
+	case '^': /* PM */
+	case '_': /* APC */
+		vt->state = VT_STR;
+		break;
+	case '(':
+	case ')':
+		vt->inter = c;
+		vt->state = VT_ESC_CHARSET;
+		break;
+	case ' ':
+	case '#':
+	case '%':
+	case '*':
+	case '+':
+		vt->inter = c;
+		vt->state = VT_ESC_CHARSET;
+		break;
+	case '7': /* DECSC */
+		vt_save_cursor(vt);
+		break;
+	case '8': /* DECRC */
+		vt_restore_cursor(vt);
+		break;
+	case '=': /* DECKPAM */
+		vt->mode |= MODE_APPKEYPAD;
+		break;
+	case '>': /* DECKPNM */
+		vt->mode &= ~MODE_APPKEYPAD;
+		break;
+	case 'D': /* IND */
+		vt_linefeed(vt);
+		break;
+	case 'E': /* NEL */
+		vt_linefeed(vt);
+		vt->col = 0;
+		vt->wrapnext = false;
+		break;
+	case 'M': /* RI */
+		vt_reverse_linefeed(vt);
+		break;
+	case 'c': /* RIS */
+		vt_reset(vt);
+		break;
+	}
+}
+
+static void vt_process(Vt *vt, const char *data, size_t len) {
+	vt->touched = true;
+	for (const unsigned char *s = (const unsigned char*)data, *end = s + len; s < end; s++) {
+		unsigned char c = *s;
+		if (vt->state == VT_STR || vt->state == VT_STR_ESC) {
+			if (c == 0x07 || (vt->state == VT_STR_ESC && c == '\\'))
+				vt->state = VT_GROUND;
+			else if (c == 0x1b)
+				vt->state = VT_STR_ESC;
+			else if (c == 0x18 || c == 0x1a)
+				vt->state = VT_GROUND;
+			else
+				vt->state = VT_STR;
+			continue;
+		}
+		if (c < 0x20 || c == 0x7f) {
+			if (c != 0x7f)
+				vt_control(vt, c);
+			continue;
+		}
+		switch (vt->state) {
+		case VT_ESC:
+			vt_esc(vt, c);
+			break;
+		case VT_ESC_CHARSET:
+			if (vt->inter == '(' || vt->inter == ')')
+				vt->graphics[vt->inter == ')'] = (c == '0');
+			vt->state = VT_GROUND;
+			break;
+		case VT_CSI:
+			if (c >= '0' && c <= '9') {
+				if (vt->nparams == 0)
+					vt->nparams = 1;
+				int *p = &vt->params[vt->nparams - 1];
+				if (*p < 65535)
+					*p = *p * 10 + (c - '0');
+			} else if (c == ';' || c == ':') {
+				if (vt->nparams == 0)
+					vt->nparams = 1;
+				if (vt->nparams < (int)countof(vt->params))
+					vt->nparams++;
+			} else if (c >= '<' && c <= '?') {
+				vt->prefix = c;
+			} else if (c >= 0x20 && c <= 0x2f) {
+				vt->inter = c;
+			} else if (c >= 0x40 && c <= 0x7e) {
+				vt->state = VT_GROUND;
+				vt_csi(vt, c);
+			}
+			break;
+		default:
+			if (c < 0x80) {
+				vt->utf8_len = 0;
+				size_t n = vt_put_ascii(vt, s, end);
+				if (n)
+					s += n - 1;
+				else
+					vt_put(vt, c);
+			} else if (c < 0xc0) {
+				if (!vt->utf8_len)
+					continue;
+				vt->utf8 = vt->utf8 << 6 | (c & 0x3f);
+				if (--vt->utf8_len == 0)
+					vt_put(vt, vt->utf8 > 0x10ffff ? 0xfffd : vt->utf8);
+			} else if (c < 0xe0) {
+				vt->utf8 = c & 0x1f;
+				vt->utf8_len = 1;
+			} else if (c < 0xf0) {
+				vt->utf8 = c & 0x0f;
+				vt->utf8_len = 2;
+			} else if (c < 0xf8) {
+				vt->utf8 = c & 0x07;
+				vt->utf8_len = 3;
+			}
+			break;
+		}
+	}
+}
+
+/* repaint helpers, they append escape sequences to the given buffer */
+
+static void vt_printf(Buffer *buf, const char *fmt, ...) {
+	char tmp[64];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(tmp, sizeof tmp, fmt, ap);
+	va_end(ap);
+	if (len > 0)
+		buffer_append(buf, tmp, (size_t)len < sizeof tmp ? (size_t)len : sizeof tmp - 1);
+}
+
+static void vt_puts(Buffer *buf, const char *s) {
+	buffer_append(buf, s, strlen(s));
+}
+
+static void vt_print_color(Buffer *buf, uint32_t color, int base) {
+	if (color == COLOR_DEFAULT)
+		return;
+	if (color > COLOR_INDEX(255))
+		vt_printf(buf, ";%d;2;%u;%u;%u", base + 8, (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+	else if (color <= COLOR_INDEX(7))
+		vt_printf(buf, ";%u", base + color - COLOR_INDEX(0));
+	else if (color <= COLOR_INDEX(15))
+		vt_printf(buf, ";%u", base + 60 + color - COLOR_INDEX(8));
+	else
+		vt_printf(buf, ";%d;5;%u", base + 8, color - COLOR_INDEX(0));
+}
+
+static void vt_print_pen(Buffer *buf, Cell *pen) {
+	static const char attrs[] = { '1', '2', '3', '4', '5', '7', '8', '9' };
+	vt_puts(buf, "\033[0");
+	for (size_t i = 0; i < countof(attrs); i++) {
+		if (pen->attr & (1 << i))
+			vt_printf(buf, ";%c", attrs[i]);
+	}
+	vt_print_color(buf, pen->fg, 30);
+	vt_print_color(buf, pen->bg, 40);
+	vt_puts(buf, "m");
+}
+
+static bool vt_same_pen(Cell *a, Cell *b) {
+	return a->attr == b->attr && a->fg == b->fg && a->bg == b->bg;
+}
+
+static void vt_print_char(Buffer *buf, uint32_t ch) {
+	char s[4];
+	size_t len;
+	if (ch < 0x80) {
+		s[0] = ch;
+		len = 1;
+	} else if (ch < 0x800) {
+		s[0] = 0xc0 | (ch >> 6);
+		s[1] = 0x80 | (ch & 0x3f);
+		len = 2;
+	} else if (ch < 0x10000) {
+		s[0] = 0xe0 | (ch >> 12);
+		s[1] = 0x80 | ((ch >> 6) & 0x3f);
+		s[2] = 0x80 | (ch & 0x3f);
+		len = 3;
+	} else {
+		s[0] = 0xf0 | (ch >> 18);
+		s[1] = 0x80 | ((ch >> 12) & 0x3f);
+		s[2] = 0x80 | ((ch >> 6) & 0x3f);
+		s[3] = 0x80 | (ch & 0x3f);
+		len = 4;
+	}
+	buffer_append(buf, s, len);
+}
+
+/* produce the escape sequences required to reproduce the current screen
+ * on a terminal of the same size, nothing is produced for a pristine screen */
+static bool vt_repaint(Vt *vt, Buffer *buf) {
+	Cell pen = { .ch = ' ' }, blank = { .ch = ' ' };
+	if (!vt->touched)
+		return false;
+	vt_puts(buf, "\033[0m\033[r\033[?6l\033[?7h\033[?25h\033(B\017\033[H\033[2J");
+	for (int row = 0; row < vt->rows; row++) {
+		Cell *line = vt_line(vt, row);
+		int last = vt->cols - 1;
+		while (last >= 0 && line[last].ch == ' ' && vt_same_pen(&line[last], &blank))
+			last--;
+		if (last < 0)
+			continue;
+		vt_printf(buf, "\033[%d;1H", row + 1);
+		for (int col = 0; col <= last; col++) {
+			Cell *cell = &line[col];
+			if (!cell->ch)
+				continue;
+			if (!vt_same_pen(cell, &pen)) {
+				vt_print_pen(buf, cell);
+				pen = *cell;
+			}
+			vt_print_char(buf, cell->ch);
+		}
+	}
+
+	if (vt->top != 0 || vt->bottom != vt->rows)
+		vt_printf(buf, "\033[%d;%dr", vt->top + 1, vt->bottom);
+	if (vt->mode & MODE_ORIGIN)
+		vt_puts(buf, "\033[?6h");
+	int row = vt->row - (vt->mode & MODE_ORIGIN ? vt->top : 0);
+	vt_printf(buf, "\033[%d;%dH", row + 1, vt->col + 1);
+	vt_print_pen(buf, &vt->pen);
+
+	for (size_t i = 0; i < countof(vt_private_modes); i++) {
+		int mode = vt_private_modes[i].mode;
+		if (mode == MODE_ORIGIN || mode == MODE_AUTOWRAP)
+			continue;
+		if (vt->mode & mode)
+			vt_printf(buf, "\033[?%dh", vt_private_modes[i].param);
+	}
+	if (!(vt->mode & MODE_AUTOWRAP))
+		vt_puts(buf, "\033[?7l");
+	if (vt->mode & MODE_HIDECURSOR)
+		vt_puts(buf, "\033[?25l");
+	if (vt->mode & MODE_INSERT)
+		vt_puts(buf, "\033[4h");
+	if (vt->mode & MODE_APPKEYPAD)
+		vt_puts(buf, "\033=");
+	if (vt->graphics[0])
+		vt_puts(buf, "\033(0");
+	if (vt->graphics[1])
+		vt_puts(buf, "\033)0");
+	if (vt->charset)
+		vt_puts(buf, "\016");
+	return buffer_len(buf) > 0;
+}